@@ -0,0 +1,276 @@
+#!/usr/bin/env lua
+
+-- Rough timings for functions which have fast paths or batch variants,
+-- compared against the plain Lua equivalents.  Like glib-test.lua, this
+-- is meant to be run and examined manually; the numbers only mean
+-- anything relative to each other on the same machine.
+
+if arg and #arg > 0 then
+    pat = arg[1]
+    if pat == 'help' or pat == '--help' or pat == '-h' or #arg > 1 then
+	print('Invoke with no parameters to run all benchmarks.')
+	print('Invoke with regex to run only sections matching regex.')
+	print("Invoke with 'list' to just list sections.")
+	print("Invoke with 'help', '--help', or '-h' to print this message.")
+	print('Sections:\n')
+	pat = 'list'
+    end
+else
+    pat = ''
+end
+
+local function head(x)
+    if pat == 'list' then
+	print(x)
+	return false
+    end
+    if x:find(pat) then
+	print('\n\n*** ' .. x .. ' ***\n')
+	return true
+    end
+    return false
+end
+
+glib = require 'glib'
+
+-- run f() reps times, and print the total time
+-- if bytes is given, also print the throughput for processing that many
+-- bytes per run
+local function bench(name, reps, f, bytes)
+    local t = glib.timer_new()
+    for i = 1, reps do
+	f()
+    end
+    t:stop()
+    local el = t:elapsed()
+    if bytes then
+	print(string.format('%-30s %10.3f ms %10.1f MB/s', name, el * 1000,
+			    bytes * reps / el / 2^20))
+    else
+	print(string.format('%-30s %10.3f ms', name, el * 1000))
+    end
+end
+
+if head("Character Set Conversion") then
+  local fields = {}
+  for i = 1, 20000 do
+    fields[i] = 'Caf' .. string.char(0xe9) .. ' ' .. i
+  end
+  bench('convert loop', 10, function()
+    local out = {}
+    for i = 1, #fields do
+      out[i] = glib.convert(fields[i], 'utf-8', 'latin1')
+    end
+  end)
+  bench('convert_batch', 10, function()
+    glib.convert_batch(fields, 'utf-8', 'latin1')
+  end)
+  local out = {}
+  bench('convert_batch (reuse dest)', 10, function()
+    glib.convert_batch(fields, 'utf-8', 'latin1', nil, out)
+  end)
+end
+
+if head("Unicode Manipulation") then
+  local doc = ('abc d\195\169f ghi\226\130\172 '):rep(20000)
+  local ascii = ('abcdefgh'):rep(40000)
+  bench('utf8_validate', 100, function() glib.utf8_validate(doc) end)
+  bench('utf8_validate (ASCII)', 100, function() glib.utf8_validate(ascii) end)
+  bench('utf8_len', 100, function() glib.utf8_len(doc) end)
+  bench('utf8_len (ASCII)', 100, function() glib.utf8_len(ascii) end)
+  bench('utf8_normalize', 10, function() glib.utf8_normalize(doc, true) end)
+  bench('utf8_normalize (stream)', 10, function()
+    local f = glib.utf8_normalize(nil, true)
+    for i = 1, #doc, 4096 do
+      f(doc:sub(i, i + 4095))
+    end
+    f()
+  end)
+  bench('utf8_strup', 100, function() glib.utf8_strup(doc) end)
+  bench('utf8_strup (ASCII)', 100, function() glib.utf8_strup(ascii) end)
+  bench('utf8_strdown (unchanged)', 100, function() glib.utf8_strdown(ascii) end)
+  local para = doc:sub(1, 60000)
+  bench('type per char', 1, function()
+    for i = 1, #para do
+      local c = para:byte(i)
+      if c < 0x80 or c >= 0xc0 then
+        glib.type(para:sub(i, i + 3))
+      end
+    end
+  end)
+  bench('utf8_runs', 1, function() glib.utf8_runs(para) end)
+  bench('utf8_segments (word)', 1, function()
+    for first, last in glib.utf8_segments(para, 'word') do end
+  end)
+  bench('utf8_segments (line)', 1, function()
+    for first, last in glib.utf8_segments(para, 'line') do end
+  end)
+  local len = glib.utf8_len(doc)
+  bench('utf8_sub windows', 1, function()
+    for i = 1, len, 1000 do
+      glib.utf8_sub(doc, i, i + 79)
+    end
+  end)
+  bench('utf8_index windows', 1, function()
+    local ui = glib.utf8_index(doc)
+    for i = 1, len, 1000 do
+      ui:sub(i, i + 79)
+    end
+  end)
+  bench('utf8_window (stream)', 1, function()
+    local w = glib.utf8_window(80)
+    for i = 1, #doc, 4096 do
+      w(doc:sub(i, i + 4095))
+    end
+    w()
+  end)
+end
+
+if head("Miscellaneous Utility Functions") then
+  local names = {}
+  for i = 1, 20000 do
+    names[i] = string.format('N%sme %d', string.char(0xc3, 0xa0 + i % 32), (i * 7919) % 20000)
+  end
+  -- unpack() can't handle this many values in Lua 5.1
+  local function copy(t)
+    local c = {}
+    for i = 1, #t do
+      c[i] = t[i]
+    end
+    return c
+  end
+  bench('qsort w/ utf8_collate', 1, function()
+    glib.qsort(copy(names), glib.utf8_collate)
+  end)
+  bench('collate_sort', 1, function()
+    glib.collate_sort(copy(names))
+  end)
+end
+
+if head("Base64 Encoding") then
+  local blk = {}
+  for i = 0, 255 do blk[#blk + 1] = string.char(i) end
+  local data = table.concat(blk):rep(100 * 2^20 / 256)
+  local enc
+  bench('base64_encode 100MB', 1, function()
+    enc = glib.base64_encode(data)
+  end, #data)
+  bench('base64_decode 100MB', 1, function()
+    glib.base64_decode(enc)
+  end, #data)
+  bench('_base64_encode_ 100MB', 1, function()
+    local e = glib.base64_encode()
+    for i = 1, #data, 2^20 do
+      e(data:sub(i, i + 2^20 - 1))
+    end
+    e()
+  end, #data)
+  bench('_base64_encode_ 100MB (1 call)', 1, function()
+    local e = glib.base64_encode()
+    e(data)
+    e()
+  end, #data)
+  bench('_base64_decode_ 100MB (1 call)', 1, function()
+    local d = glib.base64_decode()
+    d(enc)
+    d()
+  end, #data)
+end
+
+if head("Hex and Base32 Encoding") then
+  local blk = {}
+  for i = 0, 255 do blk[#blk + 1] = string.char(i) end
+  local data = table.concat(blk):rep(2^20 / 256)
+  bench('string.format %02x', 1, function()
+    data:gsub('.', function(c) return string.format('%02x', c:byte()) end)
+  end, #data)
+  bench('hex_encode', 10, function() glib.hex_encode(data) end, #data)
+  local hex = glib.hex_encode(data)
+  bench('hex_decode', 10, function() glib.hex_decode(hex) end, #data)
+  bench('base32_encode', 10, function() glib.base32_encode(data) end, #data)
+end
+
+if head("Data Checksums") then
+  local data = ('0123456789abcdef'):rep(4 * 2^20)
+  local chunk = 2^20
+  bench('sha1sum', 1, function() glib.sha1sum(data) end, #data)
+  bench('sha256sum', 1, function() glib.sha256sum(data) end, #data)
+  bench('md5+sha1+sha256 separately', 1, function()
+    local m, s1, s2 = glib.md5sum(), glib.sha1sum(), glib.sha256sum()
+    for i = 1, #data, chunk do
+      local c = data:sub(i, i + chunk - 1)
+      m(c) s1(c) s2(c)
+    end
+    m() s1() s2()
+  end, #data)
+  local path = os.tmpname()
+  local f = io.open(path, 'wb')
+  f:write(data)
+  f:close()
+  bench('sha256sum, Lua read loop', 1, function()
+    local f = io.open(path, 'rb')
+    local sum = glib.sha256sum()
+    while true do
+      local buf = f:read(4096)
+      if not buf then break end
+      sum(buf)
+    end
+    sum()
+    f:close()
+  end, #data)
+  bench('file_sum sha256', 1, function()
+    glib.file_sum(path, 'sha256')
+  end, #data)
+  bench('tree_sum sha256', 1, function()
+    glib.tree_sum(path, 'sha256')
+  end, #data)
+  bench('tree_sum sha256 (1 thread)', 1, function()
+    glib.tree_sum(path, 'sha256', {threads = 1})
+  end, #data)
+  os.remove(path)
+  local recs = {}
+  for i = 1, 100000 do
+    recs[i] = 'record ' .. i .. ' ' .. (i * 7919) % 100000
+  end
+  bench('sha1sum per record', 1, function()
+    local out = {}
+    for i = 1, #recs do
+      out[i] = glib.sha1sum(recs[i])
+    end
+  end)
+  bench('sum_batch sha1', 1, function() glib.sum_batch('sha1', recs) end)
+  bench('sum_batch sha1 (raw)', 1, function() glib.sum_batch('sha1', recs, true) end)
+  bench('xxh3 per record', 1, function()
+    for i = 1, #recs do
+      glib.xxh3(recs[i])
+    end
+  end)
+  bench('xxh64', 1, function() glib.xxh64(data) end, #data)
+  bench('xxh3', 1, function() glib.xxh3(data) end, #data)
+  bench('crc32c', 1, function() glib.crc32c(data) end, #data)
+  bench('multisum md5,sha1,sha256', 1, function()
+    local f = glib.multisum{'md5', 'sha1', 'sha256'}
+    for i = 1, #data, chunk do
+      f(data:sub(i, i + chunk - 1))
+    end
+    f()
+  end, #data)
+end
+
+if head("Secure HMAC Digests") then
+  local msgs = {}
+  for i = 1, 50000 do
+    msgs[i] = '{"id":' .. i .. ',"op":"get"}'
+  end
+  bench('sha256hmac per message', 1, function()
+    for i = 1, #msgs do
+      glib.sha256hmac('secret key', msgs[i])
+    end
+  end)
+  bench('hmac_key:sign', 1, function()
+    local k = glib.hmac_key('sha256', 'secret key')
+    for i = 1, #msgs do
+      k:sign(msgs[i])
+    end
+  end)
+end
@@ -81,6 +81,30 @@ if head("Character Set Conversion") then
   end
   ss2 = ss2 .. f()
   print("convert-s", s == s2, ss == ss2)
+  tf = io.tmpfile()
+  for c in s:gmatch('.') do
+    f(c, tf)
+  end
+  f(nil, tf)
+  tf:seek('set')
+  print("convert-f", tf:read('*a') == ss)
+  f = glib.convert(nil, 'ascii', 'utf-8', '<unk>')
+  s2 = ''
+  for c in ss:gmatch('.') do
+    s2 = s2 .. f(c)
+  end
+  s2 = s2 .. f()
+  print("convert-u", s2 == glib.convert(ss, 'ascii', 'utf-8', '<unk>'))
+  print("convert-e", select(2, glib.convert(ss, 'ascii', 'utf-8', '\195\169')), glib.convert('\255', 'ascii', 'utf-8', '?'))
+  t = glib.convert_batch({ss, 'abc', ss}, 'latin1', 'utf-8')
+  print("convert-b", t[1] == s, t[2], t[3] == s)
+  print(glib.convert_batch({'abc', ss}, 'ascii', 'utf-8', nil, t))
+  print(glib.convert_batch(t, 'ascii', 'latin1', '?', t) == t, t[1], t[2])
+  tf:close()
+  print(glib.convert_cache("latin1", "utf-8"), glib.convert_cache('y', 'z'))
+  print("convert-c", glib.convert(ss, "LATIN1", "UTF-8") == s)
+  print("convert-a", glib.convert("abc", "latin1", "utf-8"), glib.convert(ss, "utf8", "UTF-8") == ss)
+  glib.convert_flush()
 end
 
 if head("Unicode Manipulation") then
@@ -92,11 +116,53 @@ if head("Unicode Manipulation") then
   if gver >= 2.30 then
     print(glib.get_script('ç'))
   end
+  local rs, rl, rc = glib.utf8_runs('Ab, çd 42')
+  print('runs', table.concat(rs, ','), table.concat(rl, ','), table.concat(rc, ','))
+  print('runs-b', table.concat(select(3, glib.utf8_runs('a b\n', 'break')), ','))
+  local words = {}
+  for first, last, isword in glib.utf8_segments("It's 3.14, d\195\169j\195\160 vu!", 'word') do
+    if isword then words[#words + 1] = ("It's 3.14, d\195\169j\195\160 vu!"):sub(first, last) end
+  end
+  print('segments-w', table.concat(words, '|'))
+  for first, last, hard in glib.utf8_segments('one two\nthree', 'line') do
+    print('segments-l', first, last, hard)
+  end
   print(glib.utf8_sub(ss, 2, 5), glib.utf8_len(ss), glib.utf8_validate(ss))
   print(glib.utf8_validate(s))
+  s2 = ss:rep(10)
+  print("utf8-v", glib.utf8_len(s2), glib.utf8_validate(s2))
+  print(#select(2, glib.utf8_validate(s2 .. '\255' .. s2)) == #s2 + 1,
+        glib.utf8_validate(s2 .. '\0'))
+  f = glib.utf8_validate()
+  for c in s2:gmatch('.') do
+    f(c)
+  end
+  print("utf8-vs", f(), f(ss), f(s), f(ss), f())
+  f = glib.utf8_window(3)
+  print("utf8-w", table.concat(f('ab\195'), '|'), table.concat(f('\169cdef'), '|'), table.concat(f(), '|'), select(2, f()))
+  ui = glib.utf8_index(ss)
+  print(ui:sub(2, 5), ui:len(), ui:char_at(5), ui:offset(5), ui:offset(-1))
+  ui = glib.utf8_index(ss:rep(100))
+  print("utf8_index", ui:len() == glib.utf8_len(ss) * 100,
+        ui:sub(1000, 1100) == glib.utf8_sub(ss:rep(100), 1000, 1100))
   print(glib.utf8_strup(ss), glib.utf8_strdown(ss), glib.utf8_casefold(ss))
+  print('case-a', glib.utf8_strup('abc 123 \195\169x'), glib.utf8_strdown('ABC'), glib.utf8_casefold('no change'))
   print(glib.utf8_normalize(ss), #glib.utf8_normalize(ss), glib.utf8_normalize(ss, true), #glib.utf8_normalize(ss, true))
   print(glib.utf8_normalize(ss, false, true), #glib.utf8_normalize(ss, false, true), glib.utf8_normalize(ss, true, true), #glib.utf8_normalize(ss, true, true))
+  if gver >= 2.30 then
+    f = glib.utf8_normalize(nil, false, true)
+    s2 = ''
+    for c in ss:gmatch('.') do
+      s2 = s2 .. f(c)
+    end
+    s2 = s2 .. f()
+    print("normalize-s", s2 == glib.utf8_normalize(ss, false, true))
+    s = ss .. '\0' .. ss
+    f = glib.utf8_normalize(nil, true)
+    s2 = glib.utf8_normalize(ss, true)
+    print("normalize-0", f(s) .. f() == s2 .. '\0' .. s2,
+          glib.utf8_normalize(s, true) == s2)
+  end
   print(glib.utf8_collate(ss, glib.utf8_normalize(ss)))
   print(glib.utf8_collate_key(ss), glib.utf8_collate_key_for_filename(ss))
   print(#ss, #glib.utf8_to_utf16(ss), #glib.utf8_to_ucs4(ss))
@@ -122,6 +188,24 @@ if head("Base64 Encoding") then
   ss2 = ss2 .. f2()
   -- for some reason, s ~= s2.  However, ss2 == ss, so it's OK
   print(ss2 == ss, s, s2)
+  s = ('\0\1\2\255' .. ss):rep(500)
+  s2 = glib.base64_encode(s)
+  print('b64-l', glib.base64_decode(s2) == s,
+        glib.base64_decode(s2:gsub('(' .. ('.'):rep(76) .. ')', '%1\n')) == s)
+  s2 = glib.base64_encode('\251\255\254?', {url = true, pad = false})
+  print('b64-u', s2, glib.base64_decode(s2, {url = true, pad = false}) == '\251\255\254?')
+  s2 = glib.base64_encode(ss, {wrap = 16})
+  print('b64-w', s2:find('\r\n', 1, true), glib.base64_decode(s2) == ss)
+end
+
+if head("Hex and Base32 Encoding") then
+  print(glib.hex_encode(ss), glib.hex_decode(glib.hex_encode(ss)) == ss)
+  print(glib.hex_decode('DE:AD:be:ef') == '\222\173\190\239')
+  print(glib.base32_encode('foobar'), glib.base32_decode('mzxw6ytboi======'))
+  f = glib.base32_encode()
+  s2 = f('foo') .. f('b') .. f('ar') .. f()
+  f = glib.hex_decode()
+  print(s2, f('6') .. f('16') .. f('2') .. f())
 end
 
 if head("Data Checksums") then
@@ -139,6 +223,59 @@ if head("Data Checksums") then
   end
   print(f())
   print(f())
+  f = glib.multisum{'md5', 'sha256'}
+  f(ss)
+  s, s2 = f()
+  print('multisum', s == glib.md5sum(ss), s2 == glib.sha256sum(ss))
+  -- chunks of 256KB or more are summed on multiple threads
+  s3 = ss:rep(20000)
+  f = glib.multisum{'md5', 'sha256'}
+  f(s3)
+  f(ss)
+  s, s2 = f()
+  print('multisum-t', s == glib.md5sum(s3 .. ss), s2 == glib.sha256sum(s3 .. ss))
+  s = glib.sum_batch('sha1', {ss, '', 'abc'})
+  print('sum_batch', #s, s[1] == glib.sha1sum(ss), s[3] == glib.sha1sum('abc'),
+        glib.sum_batch('sha1', {ss, 'abc'}, true) ==
+          glib.sha1sum(ss, true) .. glib.sha1sum('abc', true))
+  tf = io.tmpfile()
+  tf:write(ss:rep(1000))
+  tf:seek('set')
+  print('file_sum', glib.file_sum(tf, 'sha1') == glib.sha1sum(ss:rep(1000)))
+  tf:seek('set')
+  s = glib.tree_sum(tf, 'sha256', {leaf_size = 1000})
+  f = glib.tree_sum(nil, 'sha256', {leaf_size = 1000})
+  for i = 1, 1000 do
+    f(ss)
+  end
+  s2 = f()
+  f = glib.tree_sum(nil, 'md5')
+  f('')
+  -- empty input is a single empty leaf, H(0x00)
+  print('tree_sum', s == s2, f() == glib.md5sum('\0'))
+  tf:close()
+  print(glib.file_sum('/nonexistent', 'md5'))
+  print('hash', glib.xxh64('abc', true) == '44bc2cf5ad770999',
+        glib.xxh3('abc', true) == '78af5f94892f3950',
+        glib.crc32c('123456789', true) == 'e3069283',
+        glib.crc32c('123456789') == 0xe3069283)
+  -- long enough for XXH3's block processing; odd pieces cross stripes
+  s = ss:rep(200)
+  for _, h in ipairs{'xxh3', 'xxh64'} do
+    f = glib[h]()
+    local i, n = 1, 1
+    while i <= #s do
+      f(s:sub(i, i + n - 1))
+      i = i + n
+      n = n * 3 % 301 + 1
+    end
+    print(h, f(true) == glib[h](s, true))
+  end
+  f = glib.crc32c()
+  for c in ss:gmatch('.') do
+    f(c)
+  end
+  print('crc32c', f() == glib.crc32c(ss), math.type and math.type(glib.xxh3(ss)))
 end
 
 if gver >= 2.30 and head("Secure HMAC Digests") then
@@ -152,6 +289,17 @@ if gver >= 2.30 and head("Secure HMAC Digests") then
   end
   print(f(true) == s)
   print(f())
+  k = glib.hmac_key('sha1', key)
+  s2 = k:sign(ss)
+  f = k:copy():stream()
+  f(ss)
+  print('hmac_key', s2 == glib.sha1hmac(key, ss), f() == s2, k:sign(ss, true) == s)
+  print(k:verify(ss, s2), k:verify(ss, s), k:verify(ss .. 'x', s2), k:verify(ss, 'x'))
+  -- RFC 4231 test case 2; sha512 needs GLib 2.42
+  ok, k = pcall(glib.hmac_key, 'sha512', 'Jefe')
+  print('hmac_key-512', not ok or k:sign('what do ya want for nothing?') ==
+        '164b7a7bfcf819e2e395fbe73b56e0a387bd64222e831fd610270cd7ea250554' ..
+        '9758bf75c05a994a6d034f65f8f0e6fdcaeab1a34d4a6b4b636e070a38bce737')
 end
 
 if head("Internationalization") then
@@ -364,6 +512,13 @@ if head("Miscellaneous Utility Functions") then
   for i, v in ipairs(c) do
     print(i, a[i][1], v[1], v[2], b[i][1] == v[1], b[i][2], b[i][2] == v[2])
   end
+  a = {'file10', 'b', 'File9', 'a', 'file9'}
+  b = {unpack(a)}
+  glib.collate_sort(a)
+  glib.qsort(b, glib.utf8_collate)
+  print(table.concat(a, ' '), table.concat(a) == table.concat(b))
+  glib.collate_sort(a, true)
+  print(table.concat(a, ' '))
   mt = {}
   mt.__sub = function(a, b) return #a - #b end
   a = {1}
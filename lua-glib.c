@@ -172,6 +172,7 @@ Questions/comments to darktjm@gmail.com.
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <locale.h>
 #include <fcntl.h>
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -237,6 +238,405 @@ static int win_umask(int m)
 
 #define LGLIB_IO_BUFSIZE 8192
 
+/* vectorized scanners are only provided for x86-64 with GCC-compatible */
+/* compilers; SSE2 is always present there, and AVX2 is checked at runtime */
+#if defined(__x86_64__) && defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define LGLIB_X86_64 1
+#include <immintrin.h>
+#include <cpuid.h>
+
+#define CPU_SSSE3 1
+#define CPU_AVX2  2
+#define CPU_SHA   4
+#define CPU_SSE42 8
+
+static gboolean cpu_has(int feature)
+{
+    static int has = -1;
+    if(has < 0) {
+	__builtin_cpu_init();
+	has = 0;
+	if(__builtin_cpu_supports("ssse3"))
+	    has |= CPU_SSSE3;
+	if(__builtin_cpu_supports("avx2"))
+	    has |= CPU_AVX2;
+	if(__builtin_cpu_supports("sse4.2"))
+	    has |= CPU_SSE42;
+	/* __builtin_cpu_supports() doesn't know about SHA in older GCCs */
+	if(__get_cpuid_max(0, NULL) >= 7 &&
+	   __builtin_cpu_supports("sse4.1")) {
+	    unsigned int a, b, c, d;
+	    __cpuid_count(7, 0, a, b, c, d);
+	    if(b & (1 << 29))
+		has |= CPU_SHA;
+	}
+    }
+    return (has & feature) != 0;
+}
+#endif
+
+/* length of the leading run of 7-bit ASCII characters in s */
+static size_t ascii_prefix_scalar(const char *s, size_t len)
+{
+    size_t i = 0;
+    for(; i + 8 <= len; i += 8) {
+	guint64 w;
+	memcpy(&w, s + i, 8);
+	if(w & G_GUINT64_CONSTANT(0x8080808080808080))
+	    break;
+    }
+    while(i < len && !(s[i] & 0x80))
+	i++;
+    return i;
+}
+
+#ifdef LGLIB_X86_64
+static size_t ascii_prefix_sse2(const char *s, size_t len)
+{
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16) {
+	int m = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+	if(m)
+	    return i + __builtin_ctz(m);
+    }
+    return i + ascii_prefix_scalar(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t ascii_prefix_avx2(const char *s, size_t len)
+{
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32) {
+	int m = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(s + i)));
+	if(m)
+	    return i + __builtin_ctz(m);
+    }
+    return i + ascii_prefix_sse2(s + i, len - i);
+}
+#endif
+
+static size_t ascii_prefix(const char *s, size_t len)
+{
+#ifdef LGLIB_X86_64
+    if(cpu_has(CPU_AVX2))
+	return ascii_prefix_avx2(s, len);
+    return ascii_prefix_sse2(s, len);
+#else
+    return ascii_prefix_scalar(s, len);
+#endif
+}
+
+/* ASCII case mapping: letters are lo .. lo + 25, mapped by flipping 0x20 */
+
+/* length of the leading run of ASCII characters which are not letters */
+/* in the range starting at lo, i.e., which case mapping leaves alone */
+static size_t ascii_case_span_scalar(const char *s, size_t len, char lo)
+{
+    size_t i;
+    for(i = 0; i < len; i++)
+	if((s[i] & 0x80) || (guchar)(s[i] - lo) < 26)
+	    break;
+    return i;
+}
+
+/* case map the leading ASCII run of s into d, returning its length */
+static size_t ascii_case_map_scalar(const char *s, char *d, size_t len,
+				    char lo)
+{
+    size_t i;
+    for(i = 0; i < len && !(s[i] & 0x80); i++)
+	d[i] = (guchar)(s[i] - lo) < 26 ? s[i] ^ 0x20 : s[i];
+    return i;
+}
+
+#ifdef LGLIB_X86_64
+/* 0xff for bytes which are letters in the range starting at lo */
+static inline __m128i ascii_case_mask_sse2(__m128i in, char lo)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8(lo - 1)),
+			 _mm_cmpgt_epi8(_mm_set1_epi8(lo + 26), in));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i ascii_case_mask_avx2(__m256i in, char lo)
+{
+    return _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8(lo - 1)),
+			    _mm256_cmpgt_epi8(_mm256_set1_epi8(lo + 26), in));
+}
+
+static size_t ascii_case_span_sse2(const char *s, size_t len, char lo)
+{
+    size_t i;
+    for(i = 0; i + 16 <= len; i += 16) {
+	__m128i in = _mm_loadu_si128((const __m128i *)(s + i));
+	int m = _mm_movemask_epi8(_mm_or_si128(in, ascii_case_mask_sse2(in, lo)));
+	if(m)
+	    return i + __builtin_ctz(m);
+    }
+    return i + ascii_case_span_scalar(s + i, len - i, lo);
+}
+
+static size_t ascii_case_map_sse2(const char *s, char *d, size_t len, char lo)
+{
+    size_t i;
+    for(i = 0; i + 16 <= len; i += 16) {
+	__m128i in = _mm_loadu_si128((const __m128i *)(s + i));
+	if(_mm_movemask_epi8(in))
+	    break;
+	in = _mm_xor_si128(in, _mm_and_si128(ascii_case_mask_sse2(in, lo),
+					     _mm_set1_epi8(0x20)));
+	_mm_storeu_si128((__m128i *)(d + i), in);
+    }
+    return i + ascii_case_map_scalar(s + i, d + i, len - i, lo);
+}
+
+__attribute__((target("avx2")))
+static size_t ascii_case_span_avx2(const char *s, size_t len, char lo)
+{
+    size_t i;
+    for(i = 0; i + 32 <= len; i += 32) {
+	__m256i in = _mm256_loadu_si256((const __m256i *)(s + i));
+	int m = _mm256_movemask_epi8(_mm256_or_si256(in, ascii_case_mask_avx2(in, lo)));
+	if(m)
+	    return i + __builtin_ctz(m);
+    }
+    return i + ascii_case_span_sse2(s + i, len - i, lo);
+}
+
+__attribute__((target("avx2")))
+static size_t ascii_case_map_avx2(const char *s, char *d, size_t len, char lo)
+{
+    size_t i;
+    for(i = 0; i + 32 <= len; i += 32) {
+	__m256i in = _mm256_loadu_si256((const __m256i *)(s + i));
+	if(_mm256_movemask_epi8(in))
+	    break;
+	in = _mm256_xor_si256(in, _mm256_and_si256(ascii_case_mask_avx2(in, lo),
+						   _mm256_set1_epi8(0x20)));
+	_mm256_storeu_si256((__m256i *)(d + i), in);
+    }
+    return i + ascii_case_map_sse2(s + i, d + i, len - i, lo);
+}
+#endif
+
+static size_t ascii_case_span(const char *s, size_t len, char lo)
+{
+#ifdef LGLIB_X86_64
+    if(cpu_has(CPU_AVX2))
+	return ascii_case_span_avx2(s, len, lo);
+    return ascii_case_span_sse2(s, len, lo);
+#else
+    return ascii_case_span_scalar(s, len, lo);
+#endif
+}
+
+static size_t ascii_case_map(const char *s, char *d, size_t len, char lo)
+{
+#ifdef LGLIB_X86_64
+    if(cpu_has(CPU_AVX2))
+	return ascii_case_map_avx2(s, d, len, lo);
+    return ascii_case_map_sse2(s, d, len, lo);
+#else
+    return ascii_case_map_scalar(s, d, len, lo);
+#endif
+}
+
+/* UTF-8 validation, as in g_utf8_validate() with a length (i.e., NULs */
+/* are invalid), vectorized using the lookup table method of Keiser and */
+/* Lemire.  The vector code only finds a prefix known to be valid; */
+/* GLib is used to scan the rest, for exact results in the invalid case */
+
+#ifdef LGLIB_X86_64
+/* error bits, set by looking up the high and low nybbles of each byte */
+/* and the high nybble of the byte following it */
+#define U8_TOO_SHORT  (1 << 0) /* lead not followed by continuation */
+#define U8_TOO_LONG   (1 << 1) /* ASCII followed by continuation */
+#define U8_OVERLONG_3 (1 << 2)
+#define U8_TOO_LARGE  (1 << 3)
+#define U8_SURROGATE  (1 << 4)
+#define U8_OVERLONG_2 (1 << 5)
+#define U8_TOO_LARGE_1000 (1 << 6)
+#define U8_OVERLONG_4 (1 << 6)
+#define U8_TWO_CONTS  (1 << 7) /* continuation not preceded by lead */
+#define U8_CARRY (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+#define U8_BYTE_1_HIGH \
+    U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, \
+    U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, \
+    U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, \
+    U8_TOO_SHORT | U8_OVERLONG_2, \
+    U8_TOO_SHORT, \
+    U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE, \
+    U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4
+#define U8_BYTE_1_LOW \
+    U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4, \
+    U8_CARRY | U8_OVERLONG_2, \
+    U8_CARRY, \
+    U8_CARRY, \
+    U8_CARRY | U8_TOO_LARGE, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000
+#define U8_BYTE_2_HIGH \
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, \
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, \
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | \
+	U8_TOO_LARGE_1000 | U8_OVERLONG_4, \
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | \
+	U8_TOO_LARGE, \
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | \
+	U8_TOO_LARGE, \
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | \
+	U8_TOO_LARGE, \
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT
+
+/* the vector code checks whole blocks; i is the end of the valid ones */
+/* back up to the start of the last (possibly incomplete) character */
+static size_t utf8_block_end(const char *s, size_t i, size_t *nchars)
+{
+    size_t e = i;
+    while(e > 0 && e + 3 > i && (s[e - 1] & 0xc0) == 0x80)
+	e--;
+    if(e > 0 && (guchar)s[e - 1] >= 0xc0) {
+	/* the lead byte was counted */
+	e--;
+	if(nchars)
+	    --*nchars;
+    } else
+	e = i; /* last character was complete */
+    return e;
+}
+
+__attribute__((target("ssse3")))
+static size_t utf8_prefix_ssse3(const char *s, size_t len, size_t *nchars)
+{
+    const __m128i b1h = _mm_setr_epi8(U8_BYTE_1_HIGH);
+    const __m128i b1l = _mm_setr_epi8(U8_BYTE_1_LOW);
+    const __m128i b2h = _mm_setr_epi8(U8_BYTE_2_HIGH);
+    const __m128i nyb = _mm_set1_epi8(0x0f), zero = _mm_setzero_si128();
+    __m128i prev = zero;
+    size_t i, n = 0;
+
+    for(i = 0; i + 16 <= len; i += 16) {
+	__m128i in = _mm_loadu_si128((const __m128i *)(s + i)), err;
+	if(!_mm_movemask_epi8(_mm_or_si128(in, prev))) {
+	    /* ASCII, and no character was left incomplete */
+	    if(_mm_movemask_epi8(_mm_cmpeq_epi8(in, zero)))
+		break;
+	    n += 16;
+	    prev = in;
+	    continue;
+	}
+	{
+	    __m128i p1 = _mm_alignr_epi8(in, prev, 15);
+	    __m128i p2 = _mm_alignr_epi8(in, prev, 14);
+	    __m128i p3 = _mm_alignr_epi8(in, prev, 13);
+	    __m128i sc = _mm_and_si128(_mm_and_si128(
+		_mm_shuffle_epi8(b1h, _mm_and_si128(_mm_srli_epi16(p1, 4), nyb)),
+		_mm_shuffle_epi8(b1l, _mm_and_si128(p1, nyb))),
+		_mm_shuffle_epi8(b2h, _mm_and_si128(_mm_srli_epi16(in, 4), nyb)));
+	    /* 3rd and 4th bytes of a sequence must be continuations */
+	    __m128i m23 = _mm_or_si128(_mm_subs_epu8(p2, _mm_set1_epi8(0xe0 - 0x80)),
+				       _mm_subs_epu8(p3, _mm_set1_epi8(0xf0 - 0x80)));
+	    err = _mm_xor_si128(_mm_and_si128(m23, _mm_set1_epi8(0x80)), sc);
+	    err = _mm_or_si128(err, _mm_cmpeq_epi8(in, zero));
+	}
+	if(_mm_movemask_epi8(_mm_cmpeq_epi8(err, zero)) != 0xffff)
+	    break;
+	/* count bytes which are not continuations (> -65 signed) */
+	n += __builtin_popcount(_mm_movemask_epi8(
+			_mm_cmpgt_epi8(in, _mm_set1_epi8(-65))));
+	prev = in;
+    }
+    if(nchars)
+	*nchars = n;
+    return utf8_block_end(s, i, nchars);
+}
+
+__attribute__((target("avx2")))
+static size_t utf8_prefix_avx2(const char *s, size_t len, size_t *nchars)
+{
+    const __m256i b1h = _mm256_setr_epi8(U8_BYTE_1_HIGH, U8_BYTE_1_HIGH);
+    const __m256i b1l = _mm256_setr_epi8(U8_BYTE_1_LOW, U8_BYTE_1_LOW);
+    const __m256i b2h = _mm256_setr_epi8(U8_BYTE_2_HIGH, U8_BYTE_2_HIGH);
+    const __m256i nyb = _mm256_set1_epi8(0x0f), zero = _mm256_setzero_si256();
+    __m256i prev = zero;
+    size_t i, n = 0;
+
+    for(i = 0; i + 32 <= len; i += 32) {
+	__m256i in = _mm256_loadu_si256((const __m256i *)(s + i)), err;
+	if(!_mm256_movemask_epi8(_mm256_or_si256(in, prev))) {
+	    if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(in, zero)))
+		break;
+	    n += 32;
+	    prev = in;
+	    continue;
+	}
+	{
+	    /* alignr works on 128-bit lanes, so shift in prev's high lane */
+	    __m256i pin = _mm256_permute2x128_si256(prev, in, 0x21);
+	    __m256i p1 = _mm256_alignr_epi8(in, pin, 15);
+	    __m256i p2 = _mm256_alignr_epi8(in, pin, 14);
+	    __m256i p3 = _mm256_alignr_epi8(in, pin, 13);
+	    __m256i sc = _mm256_and_si256(_mm256_and_si256(
+		_mm256_shuffle_epi8(b1h, _mm256_and_si256(_mm256_srli_epi16(p1, 4), nyb)),
+		_mm256_shuffle_epi8(b1l, _mm256_and_si256(p1, nyb))),
+		_mm256_shuffle_epi8(b2h, _mm256_and_si256(_mm256_srli_epi16(in, 4), nyb)));
+	    __m256i m23 = _mm256_or_si256(_mm256_subs_epu8(p2, _mm256_set1_epi8(0xe0 - 0x80)),
+					  _mm256_subs_epu8(p3, _mm256_set1_epi8(0xf0 - 0x80)));
+	    err = _mm256_xor_si256(_mm256_and_si256(m23, _mm256_set1_epi8(0x80)), sc);
+	    err = _mm256_or_si256(err, _mm256_cmpeq_epi8(in, zero));
+	}
+	if(!_mm256_testz_si256(err, err))
+	    break;
+	n += __builtin_popcount(_mm256_movemask_epi8(
+			_mm256_cmpgt_epi8(in, _mm256_set1_epi8(-65))));
+	prev = in;
+    }
+    if(nchars)
+	*nchars = n;
+    return utf8_block_end(s, i, nchars);
+}
+#endif
+
+/* length of a prefix of s known to be valid UTF-8 w/o NULs, ending on a */
+/* character boundary; *nchars is set to the number of characters in it */
+static size_t utf8_valid_prefix(const char *s, size_t len, size_t *nchars)
+{
+#ifdef LGLIB_X86_64
+    if(cpu_has(CPU_AVX2))
+	return utf8_prefix_avx2(s, len, nchars);
+    if(cpu_has(CPU_SSSE3))
+	return utf8_prefix_ssse3(s, len, nchars);
+#endif
+    if(nchars)
+	*nchars = 0;
+    return 0;
+}
+
+/* same as g_utf8_validate(s, len, end) */
+static gboolean utf8_validate(const char *s, size_t len, const char **end)
+{
+    size_t n = utf8_valid_prefix(s, len, NULL);
+    return g_utf8_validate(s + n, len - n, end);
+}
+
+/* same as g_utf8_strlen(s, len) */
+static size_t utf8_strlen(const char *s, size_t len)
+{
+    size_t nchars, n = utf8_valid_prefix(s, len, &nchars);
+    return nchars + g_utf8_strlen(s + n, len - n);
+}
+
 #define alloc_udata(L, v, t) \
     t *v = (t *)lua_newuserdata(L, sizeof(t)); \
     luaL_getmetatable(L, "glib."#t); \
@@ -371,35 +771,428 @@ Character Set Conversion
 @section Character Set Conversion
 */
 
+/* idle iconv descriptors are cached per lua_State, keyed by to\nfrom */
+/* the cache itself lives in the registry under glib.iconv */
+#define ICONV_KEYLEN 128
+
+typedef struct iconv_cache {
+    GHashTable *h;
+} iconv_cache;
+
+/* hash table values; entries stay even if cd is in use to avoid churn */
+typedef struct iconv_slot {
+    GIConv cd;
+} iconv_slot;
+
+static void free_iconv_slot(gpointer p)
+{
+    iconv_slot *slot = p;
+    if(slot->cd)
+	g_iconv_close(slot->cd);
+    g_free(slot);
+}
+
+static int free_iconv_cache(lua_State *L)
+{
+    get_udata(L, 1, st, iconv_cache);
+    if(st->h) {
+	g_hash_table_destroy(st->h);
+	st->h = NULL;
+    }
+    return 0;
+}
+
+static GHashTable *get_iconv_cache(lua_State *L)
+{
+    iconv_cache *ic;
+    lua_getfield(L, LUA_REGISTRYINDEX, "glib.iconv");
+    ic = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return ic ? ic->h : NULL;
+}
+
+/* build normalized cache key; returns empty key if too long to cache */
+static void iconv_key(char *key, const char *to, const char *from)
+{
+    char *p;
+    if(g_snprintf(key, ICONV_KEYLEN, "%s\n%s", to, from) >= ICONV_KEYLEN) {
+	*key = 0;
+	return;
+    }
+    for(p = key; *p; p++)
+	*p = g_ascii_tolower(*p);
+}
+
+/* get a reset descriptor, either from the cache or freshly opened */
+static GIConv iconv_acquire(lua_State *L, const char *key, const char *to,
+			    const char *from)
+{
+    GHashTable *h = *key ? get_iconv_cache(L) : NULL;
+    iconv_slot *slot = h ? g_hash_table_lookup(h, key) : NULL;
+    GIConv cd;
+    if(slot && slot->cd) {
+	cd = slot->cd;
+	slot->cd = NULL;
+	g_iconv(cd, NULL, NULL, NULL, NULL);
+	return cd;
+    }
+    return g_iconv_open(to, from);
+}
+
+/* return a descriptor obtained from iconv_acquire() to the cache */
+static void iconv_release(lua_State *L, const char *key, GIConv cd)
+{
+    GHashTable *h = *key ? get_iconv_cache(L) : NULL;
+    iconv_slot *slot;
+    if(!h) {
+	g_iconv_close(cd);
+	return;
+    }
+    slot = g_hash_table_lookup(h, key);
+    if(!slot) {
+	slot = g_new0(iconv_slot, 1);
+	g_hash_table_insert(h, g_strdup(key), slot);
+    }
+    if(slot->cd)
+	g_iconv_close(cd);
+    else
+	slot->cd = cd;
+}
+
+/* read to/from charset args, resolving nil and 'filename' */
+static void get_charsets(lua_State *L, int arg, const char **to,
+			 const char **from)
+{
+    if(lua_isnoneornil(L, arg))
+	g_get_charset(to);
+    else
+	*to = luaL_checkstring(L, arg);
+    if(lua_isnoneornil(L, arg + 1))
+	g_get_charset(from);
+    else
+	*from = luaL_checkstring(L, arg + 1);
+    if(!strcasecmp(*from, "filename")) {
+	const gchar **fncs;
+	g_get_filename_charsets(&fncs);
+	*from = fncs[0];
+    }
+    if(!strcasecmp(*to, "filename")) {
+	const gchar **fncs;
+	g_get_filename_charsets(&fncs);
+	*to = fncs[0];
+    }
+}
+
+static int no_conversion(lua_State *L, const char *to, const char *from)
+{
+    lua_pushnil(L);
+    lua_pushfstring(L, "Conversion from character set '%s' to '%s' is not supported",
+		    from, to);
+    return 2;
+}
+
+/* true if charset is known to encode 7-bit ASCII as itself */
+/* returns 1 for ASCII-compatible charsets and 2 for UTF-8 */
+static int ascii_charset(const char *cs)
+{
+    static const char * const compat[] = {
+	"iso8859", "latin", "cp125", "windows125", "koi8"
+    };
+    char buf[32], *p = buf;
+    int i;
+
+    /* normalize: lower-case and ignore punctuation */
+    for(; *cs && p < buf + sizeof(buf) - 1; cs++)
+	if(*cs != '-' && *cs != '_')
+	    *p++ = g_ascii_tolower(*cs);
+    if(*cs)
+	return 0;
+    *p = 0;
+    if(!strcmp(buf, "utf8"))
+	return 2;
+    if(!strcmp(buf, "ascii") || !strcmp(buf, "usascii") ||
+       !strcmp(buf, "ansix3.41968") || !strcmp(buf, "646"))
+	return 1;
+    for(i = 0; i < G_N_ELEMENTS(compat); i++)
+	if(!strncmp(buf, compat[i], strlen(compat[i])))
+	    return 1;
+    return 0;
+}
+
+/* true if converting s is a no-op for an ascii_charset() pair minimum */
+static gboolean convert_is_identity(int compat, const char *s, size_t len)
+{
+    size_t n;
+    if(!compat)
+	return FALSE;
+    n = ascii_prefix(s, len);
+    /* g_utf8_validate() rejects NULs, but those are left to iconv */
+    return n == len ||
+	   (compat == 2 && utf8_validate(s + n, len - n, NULL));
+}
+
 typedef struct convert_state {
-    GIConv conv;
-    GString in_buf, out_buf;
+    GIConv conv, conv2;
+    GString in_buf, mid_buf, out_buf;
+    char key[ICONV_KEYLEN], key2[ICONV_KEYLEN];
+    int compat;
+    gchar *fallback;
 } convert_state;
 
+/* return st's descriptors to the cache and free its buffers */
+static void clear_convert_state(lua_State *L, convert_state *st)
+{
+    if(st->conv) {
+	iconv_release(L, st->key, st->conv);
+	st->conv = NULL;
+    }
+    if(st->conv2) {
+	iconv_release(L, st->key2, st->conv2);
+	st->conv2 = NULL;
+    }
+    g_free(st->in_buf.str);
+    g_free(st->mid_buf.str);
+    g_free(st->out_buf.str);
+    memset(&st->in_buf, 0, sizeof(st->in_buf));
+    memset(&st->mid_buf, 0, sizeof(st->mid_buf));
+    memset(&st->out_buf, 0, sizeof(st->out_buf));
+    g_free(st->fallback);
+    st->fallback = NULL;
+}
+
 static int free_convert_state(lua_State *L)
 {
     get_udata(L, 1, st, convert_state);
-    if(st->conv)
-	g_iconv_close(st->conv);
-    if(st->in_buf.str)
-	g_free(st->in_buf.str);
-    if(st->out_buf.str)
-	g_free(st->out_buf.str);
+    clear_convert_state(L, st);
     return 0;
 }
 
+/* run iconv into out starting at *olen */
+/* if outf is given, full buffers are written out rather than growing it */
+/* returns 0 or errno; EINVAL means incomplete input was left in *inb */
+static int convert_step(GIConv cd, GString *out, gchar **inb, gsize *insz,
+			gsize *olen, FILE *outf)
+{
+    if(!out->allocated_len)
+	g_string_set_size(out, 32);
+    while(1) {
+	gchar *outb = out->str + *olen;
+	gsize outsz = out->allocated_len - *olen;
+	gsize ret = g_iconv(cd, inb, insz, &outb, &outsz);
+	int en = errno;
+	*olen = (gsize)(outb - out->str);
+	if(ret != (gsize)-1)
+	    return 0;
+	if(en != E2BIG)
+	    return en;
+	if(outf) {
+	    if(*olen && fwrite(out->str, *olen, 1, outf) != 1)
+		return errno ? errno : EIO;
+	    *olen = 0;
+	} else
+	    g_string_set_size(out, out->allocated_len * 2 - 1);
+    }
+}
+
+/* returned instead of an errno value if the fallback can't be converted */
+#define CONVERT_EFALLBACK -1
+
+/* convert UTF-8 using conv2, replacing unconvertible chars w/ fallback */
+/* this is what g_convert_with_fallback() does after its first attempt */
+static int convert_fallback(convert_state *st, gchar **inb, gsize *insz,
+			    gsize *olen, FILE *outf)
+{
+    while(1) {
+	int en = convert_step(st->conv2, &st->out_buf, inb, insz, olen, outf);
+	gunichar ch;
+	gchar *fb;
+	gsize fbsz;
+
+	if(en != EILSEQ || !*inb)
+	    return en;
+	/* invalid input is still an error */
+	ch = g_utf8_get_char_validated(*inb, *insz);
+	if(ch == (gunichar)-1 || ch == (gunichar)-2)
+	    return en;
+	fb = st->fallback;
+	fbsz = strlen(fb);
+	en = convert_step(st->conv2, &st->out_buf, &fb, &fbsz, olen, outf);
+	if(en)
+	    return en == EILSEQ || en == EINVAL ? CONVERT_EFALLBACK : en;
+	fbsz = (gsize)(g_utf8_next_char(*inb) - *inb);
+	*inb += fbsz;
+	*insz -= fbsz;
+    }
+}
+
+/* convert one piece of a stream; a NULL *inb flushes the shift state */
+static int convert_chunk(convert_state *st, gchar **inb, gsize *insz,
+			 gsize *olen, FILE *outf)
+{
+    gchar *mb;
+    gsize msz = 0;
+    int en, en2;
+
+    if(!st->fallback)
+	return convert_step(st->conv, &st->out_buf, inb, insz, olen, outf);
+    /* input is already UTF-8 */
+    if(!st->conv)
+	return convert_fallback(st, inb, insz, olen, outf);
+    /* otherwise, convert to UTF-8 first; this never splits characters */
+    en = convert_step(st->conv, &st->mid_buf, inb, insz, &msz, NULL);
+    if(en && en != EINVAL)
+	return en;
+    mb = st->mid_buf.str;
+    en2 = msz ? convert_fallback(st, &mb, &msz, olen, outf) : 0;
+    if(!en2 && !*inb) {
+	mb = NULL;
+	en2 = convert_fallback(st, &mb, &msz, olen, outf);
+    }
+    return en2 ? en2 : en;
+}
+
+/* return conversion state to its initial state, discarding partial input */
+static void reset_convert_state(convert_state *st)
+{
+    if(st->conv)
+	g_iconv(st->conv, NULL, NULL, NULL, NULL);
+    if(st->conv2)
+	g_iconv(st->conv2, NULL, NULL, NULL, NULL);
+    if(st->in_buf.len)
+	g_string_truncate(&st->in_buf, 0);
+}
+
+/* push nil and a message for convert_chunk() error en; the wording */
+/* matches g_convert()'s where there is an equivalent */
+static int convert_error(lua_State *L, const convert_state *st, int en)
+{
+    lua_pushnil(L);
+    if(en == EINVAL)
+	lua_pushliteral(L, "Partial character sequence at end of input");
+    else if(en == EILSEQ)
+	lua_pushliteral(L, "Invalid byte sequence in conversion input");
+    else if(en == CONVERT_EFALLBACK) {
+	/* the target is the first part of the key */
+	const char *nl = strchr(st->key2, '\n');
+	lua_pushlstring(L, st->key2, nl ? nl - st->key2 : 0);
+	lua_pushfstring(L, "Cannot convert fallback '%s' to codeset '%s'",
+			st->fallback, lua_tostring(L, -1));
+	lua_remove(L, -2);
+    } else
+	lua_pushstring(L, strerror(en));
+    return 2;
+}
+
+/* convert a complete string into st->out_buf, leaving st reset */
+static int convert_whole(convert_state *st, const char *s, size_t sz,
+			 gsize *olen)
+{
+    gchar *inb = (gchar *)s;
+    gsize insz = sz;
+    int en;
+
+    *olen = 0;
+    en = insz ? convert_chunk(st, &inb, &insz, olen, NULL) : 0;
+    if(!en) {
+	/* flush any shift state */
+	inb = NULL;
+	en = convert_chunk(st, &inb, &insz, olen, NULL);
+    }
+    if(en)
+	reset_convert_state(st);
+    return en;
+}
+
+/* push a new conversion state for to<-from, w/ optional fallback */
+/* with a fallback, conversion is from->utf8->to (skipping from->utf8 if */
+/* from is utf8), and utf8->to replaces unconvertible chars */
+/* returns NULL after pushing nil + error message on failure */
+static convert_state *new_convert_state(lua_State *L, const char *to,
+					const char *from, const char *fallback)
+{
+    char key[ICONV_KEYLEN], key2[ICONV_KEYLEN];
+    GIConv cd, cd2 = NULL;
+
+    if(fallback) {
+	iconv_key(key2, to, "UTF-8");
+	cd2 = iconv_acquire(L, key2, to, "UTF-8");
+	if(cd2 == (GIConv)-1) {
+	    no_conversion(L, to, "UTF-8");
+	    return NULL;
+	}
+	if(ascii_charset(from) == 2)
+	    cd = NULL;
+	else {
+	    iconv_key(key, "UTF-8", from);
+	    cd = iconv_acquire(L, key, "UTF-8", from);
+	    if(cd == (GIConv)-1) {
+		iconv_release(L, key2, cd2);
+		no_conversion(L, "UTF-8", from);
+		return NULL;
+	    }
+	}
+    } else {
+	iconv_key(key, to, from);
+	cd = iconv_acquire(L, key, to, from);
+	if(cd == (GIConv)-1) {
+	    no_conversion(L, to, from);
+	    return NULL;
+	}
+    }
+    {
+	alloc_udata(L, st, convert_state);
+	if(cd) {
+	    st->conv = cd;
+	    strcpy(st->key, key);
+	}
+	if(cd2) {
+	    st->conv2 = cd2;
+	    strcpy(st->key2, key2);
+	    st->fallback = g_strdup(fallback);
+	}
+	st->compat = MIN(ascii_charset(to), ascii_charset(from));
+	return st;
+    }
+}
+
+/* return the open FILE of the Lua file at arg; raises an error if closed */
+static FILE *check_file(lua_State *L, int arg)
+{
+#if LUA_VERSION_NUM <= 501
+    FILE **f = luaL_checkudata(L, arg, LUA_FILEHANDLE);
+    luaL_argcheck(L, *f != NULL, arg, "attempt to use a closed file");
+    return *f;
+#else
+    luaL_Stream *str = luaL_checkudata(L, arg, LUA_FILEHANDLE);
+    /* like liolib's isclosed(); f is left dangling by io.close() */
+    luaL_argcheck(L, str->closef != NULL, arg, "attempt to use a closed file");
+    return str->f;
+#endif
+}
+
 /***
 Stream character conversion function returned by `convert`.
 This function is returned by `convert` to support converting
 streams piecewise.  Simply call with string arguments, accumulating
 the returned strings.  When finished with the stream, call with
 no arguments.  This will return the final string to append and reset
-the stream for reuse.
+the stream for reuse.  The conversion state and its buffers are kept
+across resets, so a converter may be reused for many streams.
+
+If an output file is given, the converted text is written directly
+to that file rather than being returned.  The converter then uses a
+fixed-size buffer, so converting an arbitrarily large stream this way
+does not allocate any memory once the first piece has been processed.
 @function _convert_
 @see convert
 @tparam[opt] string str The next piece of the string to convert;
- absent to finish conversion
-@treturn string The next piece of the converted string
+ absent or `nil` to finish conversion
+@tparam[optchain] file outf A Lua file to which the converted output is
+ written, instead of returning it
+@treturn string|boolean The next piece of the converted string, or true
+ if *outf* was given
+@raise Returns `nil` and error message string on error.  The stream is
+ reset in that case.
 @usage
 c = glib.convert(nil, 'utf-8', 'latin1')
 while true do
@@ -408,53 +1201,80 @@ while true do
   outf:write(c(buf))
 end
 outf:write(c())
+-- or, equivalently, without creating any intermediate strings
+while true do
+  buf = inf:read(4096)
+  if not buf then break end
+  c(buf, outf)
+end
+c(nil, outf)
 */
 
 static int stream_convert(lua_State *L)
 {
-    const char *s;
+    const char *s, *out;
     size_t sz;
+    FILE *outf = NULL;
+    gchar *inb;
+    gsize insz, olen = 0;
+    int en;
+    gboolean ident;
     get_udata(L, lua_upvalueindex(1), st, convert_state);
-    if(!lua_gettop(L)) {
+    if(lua_isnoneornil(L, 1)) {
 	s = NULL;
 	sz = 0;
     } else
 	/* normal */
 	s = luaL_checklstring(L, 1, &sz);
-    if(s && st->in_buf.len) {
-	g_string_append_len(&st->in_buf, s, sz);
-	sz = st->in_buf.len;
-    }
+    if(!lua_isnoneornil(L, 2))
+	outf = check_file(L, 2);
     if(!st->out_buf.allocated_len)
-	g_string_set_size(&st->out_buf, sz > 32 ? sz : 32);
-    {
-	gchar *inb = !s ? NULL : st->in_buf.len ? st->in_buf.str : (gchar *)s, *outb;
-	gsize insz = sz, outsz, ret;
-	while(1) {
-	    outb = st->out_buf.str;
-	    outsz = st->out_buf.allocated_len;
-	    ret = g_iconv(st->conv, &inb, &insz, &outb, &outsz);
-	    if(ret >= 0 || errno != E2BIG)
-		break;
-	    g_string_set_size(&st->out_buf, st->out_buf.allocated_len * 2 - 1);
-	}
-	if(ret < 0)
-	    lua_pushnil(L);
-	else
-	    lua_pushlstring(L, st->out_buf.str, (ptrdiff_t)(outb - st->out_buf.str));
-	g_string_set_size(&st->in_buf, 0);
-	if(s && insz != 0)
+	g_string_set_size(&st->out_buf, outf ? LGLIB_IO_BUFSIZE :
+					    sz > 32 ? sz : 32);
+    ident = s && !st->in_buf.len && convert_is_identity(st->compat, s, sz);
+    if(ident) {
+	/* no conversion necessary */
+	inb = NULL;
+	insz = 0;
+    } else if(st->in_buf.len) {
+	/* any leftover partial character is prepended to the new input */
+	if(s)
+	    g_string_append_len(&st->in_buf, s, sz);
+	inb = st->in_buf.str;
+	insz = st->in_buf.len;
+    } else {
+	inb = (gchar *)s;
+	insz = sz;
+    }
+    en = insz ? convert_chunk(st, &inb, &insz, &olen, outf) : 0;
+    if(!s && !en) {
+	/* flush any shift state */
+	inb = NULL;
+	en = convert_chunk(st, &inb, &insz, &olen, outf);
+    }
+    if(!en || (s && en == EINVAL)) {
+	/* save partial character for next time */
+	if(st->in_buf.len)
+	    g_string_erase(&st->in_buf, 0, st->in_buf.len - insz);
+	else if(insz)
 	    g_string_append_len(&st->in_buf, inb, insz);
-	if(!s || ret < 0) {
-	    g_iconv(st->conv, NULL, NULL, NULL, NULL);
-	    if(st->in_buf.str)
-		g_free(st->in_buf.str);
-	    if(st->out_buf.str)
-		g_free(st->out_buf.str);
-	    memset(&st->in_buf, 0, sizeof(st->in_buf));
-	    memset(&st->out_buf, 0, sizeof(st->out_buf));
-	}
-    }
+	en = 0;
+    }
+    out = ident ? s : st->out_buf.str;
+    if(ident)
+	olen = sz;
+    if(!en && outf && olen && fwrite(out, olen, 1, outf) != 1)
+	en = errno ? errno : EIO;
+    if(!s || en)
+	reset_convert_state(st);
+    if(en)
+	return convert_error(L, st, en);
+    if(outf)
+	lua_pushboolean(L, 1);
+    else if(ident)
+	lua_pushvalue(L, 1);
+    else
+	lua_pushlstring(L, out, olen);
     return 1;
 }
 
@@ -463,8 +1283,13 @@ Convert strings from one character set to another.
 This is a wrapper for `g_convert()` and friends.  To convert a stream,
 pass in no arguments or `nil` for str.  The return value is either
 the converted string, or a function matching the `_convert_` function.
+Conversion descriptors are kept open and reused between calls; see
+`convert_cache`.  If both character sets are known to be supersets of
+ASCII and *str* is pure ASCII, or both are UTF-8 and *str* is valid
+UTF-8, *str* is returned as-is without invoking iconv at all.
 @function convert
 @see _convert_
+@see convert_cache
 @tparam[opt] string str The string to convert, or `nil`/absent to produce a
  streaming converter
 @tparam[optchain] string to The target character set. This may be `nil` or
@@ -474,64 +1299,71 @@ the converted string, or a function matching the `_convert_` function.
  absent to indicate the current locale.  This may be 'filename' to
  indicate the filename character set.
 @tparam[optchain] string fallback Any characters in *from* which have no
- equivalent in *to* are converted to this string.  This is not
- supported in stream mode.
+ equivalent in *to* are converted to this string.  In stream mode,
+ input is always converted to UTF-8 first (unless *from* is UTF-8)
+ and then to *to* with replacement, so only the current piece of the
+ stream is held in memory.
 @treturn string Converted string, if *str* was specified
 @treturn function stream convert function, if *str* was `nil` or missing
-@raise Returns `nil` and error message string on error.
+@raise Returns `nil` and error message string on error.  With a fallback,
+ the message says whether the input was invalid or the fallback itself
+ could not be converted to *to*.
 */
 static int glib_convert(lua_State *L)
 {
-    const char *s, *from = NULL, *to = NULL;
+    const char *s, *from = NULL, *to = NULL, *fallback;
     size_t slen = 0;
     GError *err = NULL;
     char *ret;
     gsize retlen;
+    char key[ICONV_KEYLEN];
+    GIConv cd;
 
-    if(lua_isnoneornil(L, 2))
-	g_get_charset(&to);
-    else
-	to = luaL_checkstring(L, 2);
-    if(lua_isnoneornil(L, 3))
-	g_get_charset(&from);
-    else
-	from = luaL_checkstring(L, 3);
-    if(!strcasecmp(from, "filename")) {
-	const gchar **fncs;
-	g_get_filename_charsets(&fncs);
-	from = fncs[0];
-    }
-    if(!strcasecmp(to, "filename")) {
-	const gchar **fncs;
-	g_get_filename_charsets(&fncs);
-	to = fncs[0];
-    }
+    get_charsets(L, 2, &to, &from);
+    iconv_key(key, to, from);
+    fallback = lua_isnoneornil(L, 4) ? NULL : luaL_checkstring(L, 4);
     if(lua_isnoneornil(L, 1)) {
-	/* there's no way I'm repeating glib's fallback code */
-	/* it does the following: */
+	/* glib's fallback code does the following: */
 	/*   -> if a straight convert succeeds, return that */
 	/*   -> otherwise, convert from->utf8->to */
-	/*      utf8->to is done 1 char at a time, replacing failures */
-	/* the only way to support this in a stream is to always assume */
-	/* failures will occur, forcing dual char-by-char conversions */
-	if(lua_gettop(L) > 3)
-	    luaL_argerror(L, 4, "fallback not supported for streams");
-	else {
-	    alloc_udata(L, st, convert_state);
-	    st->conv = g_iconv_open(to, from);
-	    lua_pushcclosure(L, stream_convert, 1);
-	    return 1;
-	}
+	/*      utf8->to replaces unconvertible chars with the fallback */
+	/* a stream can't be retried, so with a fallback it always does */
+	/* the two-step conversion (skipping from->utf8 if from is utf8) */
+	if(!new_convert_state(L, to, from, fallback))
+	    return 2;
+	lua_pushcclosure(L, stream_convert, 1);
+	return 1;
     }
     s = luaL_checklstring(L, 1, &slen);
-    if(lua_isnoneornil(L, 4))
-	ret = g_convert(s, slen, to, from, NULL, &retlen, &err);
-    else
-	ret = g_convert_with_fallback(s, slen, to, from,
-				      luaL_checkstring(L, 4), NULL, &retlen,
-				      &err);
-    if(err) {
-	lua_pushnil(L);
+    if(convert_is_identity(MIN(ascii_charset(to), ascii_charset(from)),
+			   s, slen)) {
+	lua_pushvalue(L, 1);
+	return 1;
+    }
+    cd = iconv_acquire(L, key, to, from);
+    if(cd == (GIConv)-1)
+	return no_conversion(L, to, from);
+    ret = g_convert_with_iconv(s, slen, cd, NULL, &retlen, &err);
+    iconv_release(L, key, cd);
+    /* like g_convert_with_fallback(), only use the fallback if the */
+    /* direct conversion fails, but with cached descriptors */
+    if(fallback && err && err->domain == G_CONVERT_ERROR &&
+       err->code == G_CONVERT_ERROR_ILLEGAL_SEQUENCE) {
+	convert_state *st;
+	int en;
+	g_error_free(err);
+	if(!(st = new_convert_state(L, to, from, fallback)))
+	    return 2;
+	en = convert_whole(st, s, slen, &retlen);
+	if(en)
+	    convert_error(L, st, en);
+	else
+	    lua_pushlstring(L, st->out_buf.str, retlen);
+	clear_convert_state(L, st);
+	return en ? 2 : 1;
+    }
+    if(err) {
+	lua_pushnil(L);
 	lua_pushstring(L, err->message);
 	g_error_free(err);
 	return 2;
@@ -542,6 +1374,126 @@ static int glib_convert(lua_State *L)
     }
 }
 
+/***
+Convert an array of strings from one character set to another.
+This is equivalent to calling `convert` on every element of *tbl*,
+but the character set names are only looked up once, and a single
+conversion descriptor and output buffer are used for all elements.
+It is much faster than a Lua loop for large arrays of short strings.
+Elements which need no conversion (e.g. pure ASCII text when both
+character sets are ASCII-compatible) are stored as-is.
+@function convert_batch
+@see convert
+@tparam {string,...} tbl The strings to convert
+@tparam[opt] string to The target character set, as for `convert`
+@tparam[optchain] string from The source character set, as for `convert`
+@tparam[optchain] string fallback The replacement for characters which
+ cannot be converted, as for `convert`
+@tparam[optchain] table dest The table to receive the results.  This
+ may be *tbl* itself to convert in place.  If absent, a new table is
+ created.
+@treturn {string,...} *dest*, or the new table, containing the
+ converted strings
+@raise Returns `nil`, an error message string, and the index of the
+ offending element on error.  If *dest* was given, elements before
+ that index have already been replaced.
+@usage
+fields = glib.convert_batch(fields, 'utf-8', 'latin1', '?', fields)
+*/
+static int glib_convert_batch(lua_State *L)
+{
+    const char *from = NULL, *to = NULL, *fallback, *s;
+    size_t n, i, sz;
+    gsize olen;
+    int en;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    get_charsets(L, 2, &to, &from);
+    fallback = lua_isnoneornil(L, 4) ? NULL : luaL_checkstring(L, 4);
+    if(!lua_isnoneornil(L, 5))
+	luaL_checktype(L, 5, LUA_TTABLE);
+    lua_settop(L, 5);
+    n = lua_rawlen(L, 1);
+    {
+	convert_state *st = new_convert_state(L, to, from, fallback);
+	if(!st)
+	    return 2;
+	if(lua_isnil(L, 5)) {
+	    lua_createtable(L, n, 0);
+	    lua_replace(L, 5);
+	}
+	for(i = 1; i <= n; i++) {
+	    lua_rawgeti(L, 1, i);
+	    if(!lua_isstring(L, -1))
+		return luaL_argerror(L, 1,
+				     lua_pushfstring(L, "string expected at index %d",
+						     (int)i));
+	    s = lua_tolstring(L, -1, &sz);
+	    if(!convert_is_identity(st->compat, s, sz)) {
+		en = convert_whole(st, s, sz, &olen);
+		if(en) {
+		    convert_error(L, st, en);
+		    lua_pushinteger(L, i);
+		    return 3;
+		}
+		lua_pop(L, 1);
+		lua_pushlstring(L, st->out_buf.str, olen);
+	    }
+	    lua_rawseti(L, 5, i);
+	}
+    }
+    lua_pushvalue(L, 5);
+    return 1;
+}
+
+/***
+Pre-open a conversion descriptor for a pair of character sets.
+Descriptors used by `convert` and `_convert_` are cached, keyed by
+the (case-insensitive) pair of character set names, and reused by later
+conversions between the same pair rather than being opened and closed
+every time.  This function opens one ahead of time, so that the first
+conversion does not pay for it, and to check that the conversion is
+supported.
+@function convert_cache
+@see convert
+@see convert_flush
+@tparam[opt] string to The target character set, as for `convert`
+@tparam[optchain] string from The source character set, as for `convert`
+@treturn boolean True
+@raise Returns `nil` and error message string if the conversion is not
+ supported.
+*/
+static int glib_convert_cache(lua_State *L)
+{
+    const char *from = NULL, *to = NULL;
+    char key[ICONV_KEYLEN];
+    GIConv cd;
+
+    get_charsets(L, 1, &to, &from);
+    iconv_key(key, to, from);
+    cd = iconv_acquire(L, key, to, from);
+    if(cd == (GIConv)-1)
+	return no_conversion(L, to, from);
+    iconv_release(L, key, cd);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/***
+Close all idle cached conversion descriptors.
+Descriptors currently in use by streaming converters are not affected,
+and return to the cache when their converter is garbage collected.
+@function convert_flush
+@see convert_cache
+*/
+static int glib_convert_flush(lua_State *L)
+{
+    GHashTable *h = get_iconv_cache(L);
+    if(h)
+	g_hash_table_remove_all(h);
+    return 0;
+}
+
 /*********************************************************************/
 /***
 Unicode Manipulation
@@ -825,6 +1777,43 @@ Returns -1 if *c* is not a hex digit.
 */
 uni_int(xdigit_value)
 
+static const char *unicode_type_name(GUnicodeType t)
+{
+    switch(t) {
+      case G_UNICODE_CONTROL: return "control";
+      case G_UNICODE_FORMAT: return "format";
+      case G_UNICODE_UNASSIGNED: return "unassigned";
+      case G_UNICODE_PRIVATE_USE: return "private_use";
+      case G_UNICODE_SURROGATE: return "surrogate";
+      case G_UNICODE_LOWERCASE_LETTER: return "lowercase_letter";
+      case G_UNICODE_MODIFIER_LETTER: return "modifier_letter";
+      case G_UNICODE_OTHER_LETTER: return "other_letter";
+      case G_UNICODE_TITLECASE_LETTER: return "titlecase_letter";
+      case G_UNICODE_UPPERCASE_LETTER: return "uppercase_letter";
+      case G_UNICODE_SPACING_MARK: return "spacing_mark";
+      case G_UNICODE_ENCLOSING_MARK: return "enclosing_mark";
+      case G_UNICODE_NON_SPACING_MARK: return "non_spacing_mark";
+      case G_UNICODE_DECIMAL_NUMBER: return "decimal_number";
+      case G_UNICODE_LETTER_NUMBER: return "letter_number";
+      case G_UNICODE_OTHER_NUMBER: return "other_number";
+      case G_UNICODE_CONNECT_PUNCTUATION: return "connect_punctuation";
+      case G_UNICODE_DASH_PUNCTUATION: return "dash_punctuation";
+      case G_UNICODE_CLOSE_PUNCTUATION: return "close_punctuation";
+      case G_UNICODE_FINAL_PUNCTUATION: return "final_punctuation";
+      case G_UNICODE_INITIAL_PUNCTUATION: return "initial_punctuation";
+      case G_UNICODE_OTHER_PUNCTUATION: return "other_punctuation";
+      case G_UNICODE_OPEN_PUNCTUATION: return "open_punctuation";
+      case G_UNICODE_CURRENCY_SYMBOL: return "currency_symbol";
+      case G_UNICODE_MODIFIER_SYMBOL: return "modifier_symbol";
+      case G_UNICODE_MATH_SYMBOL: return "math_symbol";
+      case G_UNICODE_OTHER_SYMBOL: return "other_symbol";
+      case G_UNICODE_LINE_SEPARATOR: return "line_separator";
+      case G_UNICODE_PARAGRAPH_SEPARATOR: return "paragraph_separator";
+      case G_UNICODE_SPACE_SEPARATOR: return "space_separator";
+      default: return "unknown";
+    }
+}
+
 /***
 Find Unicode character class.
 This is a wrapper for `g_unichar_type()`.
@@ -844,43 +1833,55 @@ This is a wrapper for `g_unichar_type()`.
 */
 static int glib_type(lua_State *L)
 {
-    const char *t;
     one_unichar();
-    switch(g_unichar_type(ch)) {
-      case G_UNICODE_CONTROL: t = "control"; break;
-      case G_UNICODE_FORMAT: t = "format"; break;
-      case G_UNICODE_UNASSIGNED: t = "unassigned"; break;
-      case G_UNICODE_PRIVATE_USE: t = "private_use"; break;
-      case G_UNICODE_SURROGATE: t = "surrogate"; break;
-      case G_UNICODE_LOWERCASE_LETTER: t = "lowercase_letter"; break;
-      case G_UNICODE_MODIFIER_LETTER: t = "modifier_letter"; break;
-      case G_UNICODE_OTHER_LETTER: t = "other_letter"; break;
-      case G_UNICODE_TITLECASE_LETTER: t = "titlecase_letter"; break;
-      case G_UNICODE_UPPERCASE_LETTER: t = "uppercase_letter"; break;
-      case G_UNICODE_SPACING_MARK: t = "spacing_mark"; break;
-      case G_UNICODE_ENCLOSING_MARK: t = "enclosing_mark"; break;
-      case G_UNICODE_NON_SPACING_MARK: t = "non_spacing_mark"; break;
-      case G_UNICODE_DECIMAL_NUMBER: t = "decimal_number"; break;
-      case G_UNICODE_LETTER_NUMBER: t = "letter_number"; break;
-      case G_UNICODE_OTHER_NUMBER: t = "other_number"; break;
-      case G_UNICODE_CONNECT_PUNCTUATION: t = "connect_punctuation"; break;
-      case G_UNICODE_DASH_PUNCTUATION: t = "dash_punctuation"; break;
-      case G_UNICODE_CLOSE_PUNCTUATION: t = "close_punctuation"; break;
-      case G_UNICODE_FINAL_PUNCTUATION: t = "final_punctuation"; break;
-      case G_UNICODE_INITIAL_PUNCTUATION: t = "initial_punctuation"; break;
-      case G_UNICODE_OTHER_PUNCTUATION: t = "other_punctuation"; break;
-      case G_UNICODE_OPEN_PUNCTUATION: t = "open_punctuation"; break;
-      case G_UNICODE_CURRENCY_SYMBOL: t = "currency_symbol"; break;
-      case G_UNICODE_MODIFIER_SYMBOL: t = "modifier_symbol"; break;
-      case G_UNICODE_MATH_SYMBOL: t = "math_symbol"; break;
-      case G_UNICODE_OTHER_SYMBOL: t = "other_symbol"; break;
-      case G_UNICODE_LINE_SEPARATOR: t = "line_separator"; break;
-      case G_UNICODE_PARAGRAPH_SEPARATOR: t = "paragraph_separator"; break;
-      case G_UNICODE_SPACE_SEPARATOR: t = "space_separator"; break;
-      default: t = "unknown"; break;
-    }
-    lua_pushstring(L, t);
-    return 1;
+    lua_pushstring(L, unicode_type_name(g_unichar_type(ch)));
+    return 1;
+}
+
+static const char *unicode_break_name(GUnicodeBreakType t)
+{
+    switch(t) {
+      case G_UNICODE_BREAK_MANDATORY: return "mandatory";
+      case G_UNICODE_BREAK_CARRIAGE_RETURN: return "carriage_return";
+      case G_UNICODE_BREAK_LINE_FEED: return "line_feed";
+      case G_UNICODE_BREAK_COMBINING_MARK: return "combining_mark";
+      case G_UNICODE_BREAK_SURROGATE: return "surrogate";
+      case G_UNICODE_BREAK_ZERO_WIDTH_SPACE: return "zero_width_space";
+      case G_UNICODE_BREAK_INSEPARABLE: return "inseparable";
+      case G_UNICODE_BREAK_NON_BREAKING_GLUE: return "non_breaking_glue";
+      case G_UNICODE_BREAK_CONTINGENT: return "contingent";
+      case G_UNICODE_BREAK_SPACE: return "space";
+      case G_UNICODE_BREAK_AFTER: return "after";
+      case G_UNICODE_BREAK_BEFORE: return "before";
+      case G_UNICODE_BREAK_BEFORE_AND_AFTER: return "before_and_after";
+      case G_UNICODE_BREAK_HYPHEN: return "hyphen";
+      case G_UNICODE_BREAK_NON_STARTER: return "non_starter";
+      case G_UNICODE_BREAK_OPEN_PUNCTUATION: return "open_punctuation";
+      case G_UNICODE_BREAK_CLOSE_PUNCTUATION: return "close_punctuation";
+      case G_UNICODE_BREAK_QUOTATION: return "quotation";
+      case G_UNICODE_BREAK_EXCLAMATION: return "exclamation";
+      case G_UNICODE_BREAK_IDEOGRAPHIC: return "ideographic";
+      case G_UNICODE_BREAK_NUMERIC: return "numeric";
+      case G_UNICODE_BREAK_INFIX_SEPARATOR: return "infix_separator";
+      case G_UNICODE_BREAK_SYMBOL: return "symbol";
+      case G_UNICODE_BREAK_ALPHABETIC: return "alphabetic";
+      case G_UNICODE_BREAK_PREFIX: return "prefix";
+      case G_UNICODE_BREAK_POSTFIX: return "postfix";
+      case G_UNICODE_BREAK_COMPLEX_CONTEXT: return "complex_context";
+      case G_UNICODE_BREAK_AMBIGUOUS: return "ambiguous";
+      case G_UNICODE_BREAK_UNKNOWN: return "unknown";
+      case G_UNICODE_BREAK_NEXT_LINE: return "next_line";
+      case G_UNICODE_BREAK_WORD_JOINER: return "word_joiner";
+      case G_UNICODE_BREAK_HANGUL_L_JAMO: return "hangul_l_jamo";
+      case G_UNICODE_BREAK_HANGUL_V_JAMO: return "hangul_v_jamo";
+      case G_UNICODE_BREAK_HANGUL_T_JAMO: return "hangul_t_jamo";
+      case G_UNICODE_BREAK_HANGUL_LV_SYLLABLE: return "hangul_lv_syllable";
+      case G_UNICODE_BREAK_HANGUL_LVT_SYLLABLE: return "hangul_lvt_syllable";
+      case G_UNICODE_BREAK_CLOSE_PARANTHESIS: return "close_paranthesis";
+      case G_UNICODE_BREAK_CONDITIONAL_JAPANESE_STARTER: return "conditional_japanese_starter";
+      case G_UNICODE_BREAK_HEBREW_LETTER: return "hebrew_letter";
+      default: return "unknown";
+    }
 }
 
 /***
@@ -903,51 +1904,8 @@ This is a wrapper for `g_unichar_break_type()`.
 */
 static int glib_break_type(lua_State *L)
 {
-    const char *t;
     one_unichar();
-    switch(g_unichar_break_type(ch)) {
-      case G_UNICODE_BREAK_MANDATORY: t = "mandatory"; break;
-      case G_UNICODE_BREAK_CARRIAGE_RETURN: t = "carriage_return"; break;
-      case G_UNICODE_BREAK_LINE_FEED: t = "line_feed"; break;
-      case G_UNICODE_BREAK_COMBINING_MARK: t = "combining_mark"; break;
-      case G_UNICODE_BREAK_SURROGATE: t = "surrogate"; break;
-      case G_UNICODE_BREAK_ZERO_WIDTH_SPACE: t = "zero_width_space"; break;
-      case G_UNICODE_BREAK_INSEPARABLE: t = "inseparable"; break;
-      case G_UNICODE_BREAK_NON_BREAKING_GLUE: t = "non_breaking_glue"; break;
-      case G_UNICODE_BREAK_CONTINGENT: t = "contingent"; break;
-      case G_UNICODE_BREAK_SPACE: t = "space"; break;
-      case G_UNICODE_BREAK_AFTER: t = "after"; break;
-      case G_UNICODE_BREAK_BEFORE: t = "before"; break;
-      case G_UNICODE_BREAK_BEFORE_AND_AFTER: t = "before_and_after"; break;
-      case G_UNICODE_BREAK_HYPHEN: t = "hyphen"; break;
-      case G_UNICODE_BREAK_NON_STARTER: t = "non_starter"; break;
-      case G_UNICODE_BREAK_OPEN_PUNCTUATION: t = "open_punctuation"; break;
-      case G_UNICODE_BREAK_CLOSE_PUNCTUATION: t = "close_punctuation"; break;
-      case G_UNICODE_BREAK_QUOTATION: t = "quotation"; break;
-      case G_UNICODE_BREAK_EXCLAMATION: t = "exclamation"; break;
-      case G_UNICODE_BREAK_IDEOGRAPHIC: t = "ideographic"; break;
-      case G_UNICODE_BREAK_NUMERIC: t = "numeric"; break;
-      case G_UNICODE_BREAK_INFIX_SEPARATOR: t = "infix_separator"; break;
-      case G_UNICODE_BREAK_SYMBOL: t = "symbol"; break;
-      case G_UNICODE_BREAK_ALPHABETIC: t = "alphabetic"; break;
-      case G_UNICODE_BREAK_PREFIX: t = "prefix"; break;
-      case G_UNICODE_BREAK_POSTFIX: t = "postfix"; break;
-      case G_UNICODE_BREAK_COMPLEX_CONTEXT: t = "complex_context"; break;
-      case G_UNICODE_BREAK_AMBIGUOUS: t = "ambiguous"; break;
-      case G_UNICODE_BREAK_UNKNOWN: t = "unknown"; break;
-      case G_UNICODE_BREAK_NEXT_LINE: t = "next_line"; break;
-      case G_UNICODE_BREAK_WORD_JOINER: t = "word_joiner"; break;
-      case G_UNICODE_BREAK_HANGUL_L_JAMO: t = "hangul_l_jamo"; break;
-      case G_UNICODE_BREAK_HANGUL_V_JAMO: t = "hangul_v_jamo"; break;
-      case G_UNICODE_BREAK_HANGUL_T_JAMO: t = "hangul_t_jamo"; break;
-      case G_UNICODE_BREAK_HANGUL_LV_SYLLABLE: t = "hangul_lv_syllable"; break;
-      case G_UNICODE_BREAK_HANGUL_LVT_SYLLABLE: t = "hangul_lvt_syllable"; break;
-      case G_UNICODE_BREAK_CLOSE_PARANTHESIS: t = "close_paranthesis"; break;
-      case G_UNICODE_BREAK_CONDITIONAL_JAPANESE_STARTER: t = "conditional_japanese_starter"; break;
-      case G_UNICODE_BREAK_HEBREW_LETTER: t = "hebrew_letter"; break;
-      default: t = "unknown"; break;
-    }
-    lua_pushstring(L, t);
+    lua_pushstring(L, unicode_break_name(g_unichar_break_type(ch)));
     return 1;
 }
 
@@ -1004,6 +1962,596 @@ static int glib_get_script(lua_State *L)
 }
 #endif
 
+/***
+Split a string into runs of equally classified characters.
+This walks *s* once, classifying each code point as `type`,
+`break_type` or `get_script` would, and merges adjacent code points
+with the same classification.  The results are returned as parallel
+arrays, so run *i* is `s:sub(start[i], start[i] + len[i] - 1)`.
+@function utf8_runs
+@tparam string s The utf-8-encoded string
+@tparam[opt] string what The classification to use:  `type` (the default),
+ `break` or `script`.  The `script` classification is only available with
+ GLib 2.30 or later, and results in four-letter ISO 15924 codes.
+@treturn {number,...} The starting byte position of each run
+@treturn {number,...} The length of each run, in bytes
+@treturn {string,...} The classification of each run
+@raise Generates argument error if *s* is not valid UTF-8.
+*/
+static int glib_utf8_runs(lua_State *L)
+{
+    static const char *const what_opts[] = {
+	"type", "break",
+#if GLIB_CHECK_VERSION(2, 30, 0)
+	"script",
+#endif
+	NULL
+    };
+    size_t sz, i = 0, start = 0;
+    const char *s = luaL_checklstring(L, 1, &sz);
+    int what = luaL_checkoption(L, 2, "type", what_opts), n = 0;
+    int cls, prev = -1;
+    gunichar ch;
+
+    lua_settop(L, 2);
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_newtable(L);
+    while(1) {
+	if(i < sz) {
+	    if(!(s[i] & 0x80))
+		ch = s[i];
+	    else {
+		ch = g_utf8_get_char_validated(s + i, sz - i);
+		luaL_argcheck(L, (gint32)ch >= 0, 1, "invalid UTF-8 string");
+	    }
+	    switch(what) {
+	      case 0: cls = g_unichar_type(ch); break;
+	      case 1: cls = g_unichar_break_type(ch); break;
+#if GLIB_CHECK_VERSION(2, 30, 0)
+	      default: cls = g_unichar_get_script(ch); break;
+#endif
+	    }
+	    if(cls == prev) {
+		i += g_utf8_skip[(guchar)s[i]];
+		continue;
+	    }
+	}
+	if(prev >= 0) {
+	    ++n;
+	    lua_pushnumber(L, start + 1);
+	    lua_rawseti(L, 3, n);
+	    lua_pushnumber(L, i - start);
+	    lua_rawseti(L, 4, n);
+	    switch(what) {
+	      case 0:
+		lua_pushstring(L, unicode_type_name(prev));
+		break;
+	      case 1:
+		lua_pushstring(L, unicode_break_name(prev));
+		break;
+#if GLIB_CHECK_VERSION(2, 30, 0)
+	      default: {
+		guint32 iso = GUINT32_FROM_BE(g_unicode_script_to_iso15924(prev));
+		lua_pushlstring(L, (char *)&iso, 4);
+		break;
+	      }
+#endif
+	    }
+	    lua_rawseti(L, 5, n);
+	}
+	if(i >= sz)
+	    break;
+	prev = cls;
+	start = i;
+	i += g_utf8_skip[(guchar)s[i]];
+    }
+    return 3;
+}
+
+/* Text segmentation, loosely following UAX #29 (grapheme clusters and */
+/* words) and UAX #14 (line breaks).  GLib does not expose the grapheme */
+/* and word break properties, so they are approximated from the general */
+/* category, line break class and a few explicit code points.  Rules */
+/* which need more than one character of look-behind are simplified. */
+
+/* decode the code point at *i and advance *i past it; invalid bytes are */
+/* returned as U+FFFD, one byte at a time */
+static gunichar utf8_next_char(const char *s, size_t sz, size_t *i)
+{
+    gunichar c;
+    if(!(s[*i] & 0x80))
+	return s[(*i)++];
+    c = g_utf8_get_char_validated(s + *i, sz - *i);
+    if((gint32)c < 0) {
+	++*i;
+	return 0xfffd;
+    }
+    *i += g_utf8_skip[(guchar)s[*i]];
+    return c;
+}
+
+#define is_regional_indicator(c) ((c) >= 0x1f1e6 && (c) <= 0x1f1ff)
+
+enum {
+    GB_OTHER, GB_CR, GB_LF, GB_CONTROL, GB_EXTEND, GB_ZWJ, GB_RI,
+    GB_SPACING_MARK, GB_L, GB_V, GB_T, GB_LV, GB_LVT, GB_PICT
+};
+
+static int grapheme_class(gunichar c)
+{
+    if(c < 0x80)
+	return c == '\r' ? GB_CR : c == '\n' ? GB_LF :
+	       c < 0x20 || c == 0x7f ? GB_CONTROL : GB_OTHER;
+    if(c == 0x200d)
+	return GB_ZWJ;
+    if(c == 0x200c || (c >= 0x1f3fb && c <= 0x1f3ff) ||
+       (c >= 0xe0020 && c <= 0xe007f))
+	return GB_EXTEND;
+    if(is_regional_indicator(c))
+	return GB_RI;
+    switch(g_unichar_type(c)) {
+      case G_UNICODE_CONTROL:
+      case G_UNICODE_FORMAT:
+      case G_UNICODE_LINE_SEPARATOR:
+      case G_UNICODE_PARAGRAPH_SEPARATOR:
+	return GB_CONTROL;
+      case G_UNICODE_NON_SPACING_MARK:
+      case G_UNICODE_ENCLOSING_MARK:
+	return GB_EXTEND;
+      case G_UNICODE_SPACING_MARK:
+	return GB_SPACING_MARK;
+      case G_UNICODE_OTHER_SYMBOL:
+	/* close enough to Extended_Pictographic for ZWJ sequences */
+	return c >= 0x2100 ? GB_PICT : GB_OTHER;
+      default:
+	break;
+    }
+    switch(g_unichar_break_type(c)) {
+      case G_UNICODE_BREAK_HANGUL_L_JAMO: return GB_L;
+      case G_UNICODE_BREAK_HANGUL_V_JAMO: return GB_V;
+      case G_UNICODE_BREAK_HANGUL_T_JAMO: return GB_T;
+      case G_UNICODE_BREAK_HANGUL_LV_SYLLABLE: return GB_LV;
+      case G_UNICODE_BREAK_HANGUL_LVT_SYLLABLE: return GB_LVT;
+      default: return GB_OTHER;
+    }
+}
+
+/* TRUE if there is no grapheme cluster boundary between prev and cur; */
+/* nri is the number of regional indicators in a row ending at prev, and */
+/* pict is set if prev ends a pictograph Extend* sequence */
+static gboolean grapheme_joined(int prev, int cur, int nri, gboolean pict)
+{
+    if(prev == GB_CR && cur == GB_LF)
+	return TRUE;
+    if(prev == GB_CR || prev == GB_LF || prev == GB_CONTROL ||
+       cur == GB_CR || cur == GB_LF || cur == GB_CONTROL)
+	return FALSE;
+    if(cur == GB_EXTEND || cur == GB_ZWJ || cur == GB_SPACING_MARK)
+	return TRUE;
+    switch(prev) {
+      case GB_L:
+	return cur == GB_L || cur == GB_V || cur == GB_LV || cur == GB_LVT;
+      case GB_LV:
+      case GB_V:
+	return cur == GB_V || cur == GB_T;
+      case GB_LVT:
+      case GB_T:
+	return cur == GB_T;
+      case GB_ZWJ:
+	return cur == GB_PICT && pict;
+      case GB_RI:
+	return cur == GB_RI && nri % 2;
+      default:
+	return FALSE;
+    }
+}
+
+/* return the end of the grapheme cluster starting at i */
+static size_t grapheme_end(const char *s, size_t sz, size_t i)
+{
+    int prev = grapheme_class(utf8_next_char(s, sz, &i)), cur;
+    int nri = prev == GB_RI;
+    gboolean pict = prev == GB_PICT;
+    while(i < sz) {
+	size_t j = i;
+	cur = grapheme_class(utf8_next_char(s, sz, &j));
+	if(!grapheme_joined(prev, cur, nri, pict))
+	    break;
+	nri = cur == GB_RI ? nri + 1 : 0;
+	if(cur != GB_EXTEND && cur != GB_ZWJ)
+	    pict = cur == GB_PICT;
+	prev = cur;
+	i = j;
+    }
+    return i;
+}
+
+enum {
+    WB_OTHER, WB_CR, WB_LF, WB_NEWLINE, WB_EXTEND, WB_WSEGSPACE, WB_RI,
+    WB_ALETTER, WB_NUMERIC, WB_KATAKANA, WB_EXTENDNUMLET,
+    WB_MIDLETTER, WB_MIDNUM, WB_MIDNUMLET
+};
+
+static int word_class(gunichar c)
+{
+    if(c < 0x80) {
+	if(g_ascii_isalpha(c))
+	    return WB_ALETTER;
+	if(g_ascii_isdigit(c))
+	    return WB_NUMERIC;
+	switch(c) {
+	  case '\r': return WB_CR;
+	  case '\n': return WB_LF;
+	  case '\v': case '\f': return WB_NEWLINE;
+	  case ' ': return WB_WSEGSPACE;
+	  case ':': return WB_MIDLETTER;
+	  case ',': case ';': return WB_MIDNUM;
+	  case '.': case '\'': return WB_MIDNUMLET;
+	  case '_': return WB_EXTENDNUMLET;
+	  default: return WB_OTHER;
+	}
+    }
+    switch(c) {
+      case 0x85: case 0x2028: case 0x2029:
+	return WB_NEWLINE;
+      case 0xb7: case 0x387: case 0x5f4: case 0x2027: case 0xfe13:
+      case 0xfe55: case 0xff1a:
+	return WB_MIDLETTER;
+      case 0x37e: case 0x589: case 0x60c: case 0x60d: case 0x66c:
+      case 0x7f8: case 0x2044: case 0xfe10: case 0xfe14: case 0xfe50:
+      case 0xfe54: case 0xff0c: case 0xff1b:
+	return WB_MIDNUM;
+      case 0x2018: case 0x2019: case 0x2024: case 0xfe52: case 0xff07:
+      case 0xff0e:
+	return WB_MIDNUMLET;
+      case 0xa0: case 0x2007: case 0x202f:
+	return WB_OTHER;
+    }
+    if(is_regional_indicator(c))
+	return WB_RI;
+    if((c >= 0x30a0 && c <= 0x30ff) || (c >= 0x31f0 && c <= 0x31ff) ||
+       (c >= 0xff66 && c <= 0xff9d))
+	return WB_KATAKANA;
+    switch(g_unichar_type(c)) {
+      case G_UNICODE_NON_SPACING_MARK:
+      case G_UNICODE_ENCLOSING_MARK:
+      case G_UNICODE_SPACING_MARK:
+      case G_UNICODE_FORMAT:
+	return WB_EXTEND;
+      case G_UNICODE_DECIMAL_NUMBER:
+	return WB_NUMERIC;
+      case G_UNICODE_CONNECT_PUNCTUATION:
+	return WB_EXTENDNUMLET;
+      case G_UNICODE_SPACE_SEPARATOR:
+	return WB_WSEGSPACE;
+      case G_UNICODE_LOWERCASE_LETTER:
+      case G_UNICODE_MODIFIER_LETTER:
+      case G_UNICODE_OTHER_LETTER:
+      case G_UNICODE_TITLECASE_LETTER:
+      case G_UNICODE_UPPERCASE_LETTER:
+      case G_UNICODE_LETTER_NUMBER:
+	/* ideographs, kana and SE Asian scripts are left to break */
+	/* between every character */
+	switch(g_unichar_break_type(c)) {
+	  case G_UNICODE_BREAK_IDEOGRAPHIC:
+	  case G_UNICODE_BREAK_COMPLEX_CONTEXT:
+	  case G_UNICODE_BREAK_CONDITIONAL_JAPANESE_STARTER:
+	    return WB_OTHER;
+	  default:
+	    return WB_ALETTER;
+	}
+      default:
+	return WB_OTHER;
+    }
+}
+
+/* class of the first character at or after i which is not Extend/Format */
+static int word_next_class(const char *s, size_t sz, size_t i)
+{
+    while(i < sz) {
+	int c = word_class(utf8_next_char(s, sz, &i));
+	if(c != WB_EXTEND)
+	    return c;
+    }
+    return WB_OTHER;
+}
+
+/* TRUE if there is no word boundary before cur, which ends at next; */
+/* prev and pprev are the preceding classes, ignoring Extend */
+static gboolean word_joined(const char *s, size_t sz, size_t next,
+			    int pprev, int prev, int cur, int nri)
+{
+    int n;
+    switch(cur) {
+      case WB_ALETTER:
+	return prev == WB_ALETTER || prev == WB_NUMERIC ||
+	       prev == WB_EXTENDNUMLET ||
+	       ((prev == WB_MIDLETTER || prev == WB_MIDNUMLET) &&
+		pprev == WB_ALETTER);
+      case WB_NUMERIC:
+	return prev == WB_NUMERIC || prev == WB_ALETTER ||
+	       prev == WB_EXTENDNUMLET ||
+	       ((prev == WB_MIDNUM || prev == WB_MIDNUMLET) &&
+		pprev == WB_NUMERIC);
+      case WB_KATAKANA:
+	return prev == WB_KATAKANA || prev == WB_EXTENDNUMLET;
+      case WB_EXTENDNUMLET:
+	return prev == WB_ALETTER || prev == WB_NUMERIC ||
+	       prev == WB_KATAKANA || prev == WB_EXTENDNUMLET;
+      case WB_MIDLETTER:
+	return prev == WB_ALETTER &&
+	       word_next_class(s, sz, next) == WB_ALETTER;
+      case WB_MIDNUMLET:
+      case WB_MIDNUM:
+	if(prev != WB_NUMERIC && (prev != WB_ALETTER || cur == WB_MIDNUM))
+	    return FALSE;
+	n = word_next_class(s, sz, next);
+	return n == prev;
+      case WB_RI:
+	return prev == WB_RI && nri % 2;
+      default:
+	return FALSE;
+    }
+}
+
+/* return the end of the word (or other segment) starting at i */
+static size_t word_end(const char *s, size_t sz, size_t i, gboolean *wordlike)
+{
+    gunichar c = utf8_next_char(s, sz, &i);
+    int raw, prev, pprev = WB_OTHER, cur, nri;
+    gboolean zwj = FALSE;
+    raw = prev = word_class(c);
+    nri = prev == WB_RI;
+    *wordlike = g_unichar_isalnum(c) || prev == WB_EXTENDNUMLET;
+    while(i < sz) {
+	size_t j = i;
+	c = utf8_next_char(s, sz, &j);
+	cur = word_class(c);
+	if(raw == WB_CR && cur == WB_LF)
+	    ;
+	else if(raw == WB_CR || raw == WB_LF || raw == WB_NEWLINE ||
+		cur == WB_CR || cur == WB_LF || cur == WB_NEWLINE)
+	    break;
+	else if((raw == WB_WSEGSPACE && cur == WB_WSEGSPACE) ||
+		(zwj && grapheme_class(c) == GB_PICT))
+	    ;
+	else if(cur == WB_EXTEND) {
+	    zwj = c == 0x200d;
+	    raw = cur;
+	    i = j;
+	    continue;
+	} else if(!word_joined(s, sz, j, pprev, prev, cur, nri))
+	    break;
+	nri = cur == WB_RI ? nri + 1 : 0;
+	zwj = FALSE;
+	raw = cur;
+	pprev = prev;
+	prev = cur;
+	i = j;
+    }
+    return i;
+}
+
+#define LB(x) G_UNICODE_BREAK_##x
+#define LB_ALNUM(c) ((c) == LB(ALPHABETIC) || (c) == LB(HEBREW_LETTER) || \
+		     (c) == LB(NUMERIC))
+#define LB_HANGUL(c) ((c) == LB(HANGUL_L_JAMO) || (c) == LB(HANGUL_V_JAMO) || \
+		      (c) == LB(HANGUL_T_JAMO) || \
+		      (c) == LB(HANGUL_LV_SYLLABLE) || \
+		      (c) == LB(HANGUL_LVT_SYLLABLE))
+
+static GUnicodeBreakType line_class(gunichar c)
+{
+    GUnicodeBreakType t = g_unichar_break_type(c);
+    switch(t) {
+      case LB(AMBIGUOUS):
+      case LB(SURROGATE):
+      case LB(UNKNOWN):
+	return LB(ALPHABETIC);
+      case LB(COMPLEX_CONTEXT):
+	return g_unichar_ismark(c) ? LB(COMBINING_MARK) : LB(ALPHABETIC);
+      case LB(CONDITIONAL_JAPANESE_STARTER):
+	return LB(NON_STARTER);
+      default:
+	return c == 0x200d ? LB(COMBINING_MARK) : t;
+    }
+}
+
+/* TRUE if a line may not be broken between prev and cur; before_sp is the */
+/* class before any spaces ending at prev, zwj is set if prev is U+200D, */
+/* and nri is the number of regional indicators in a row ending at prev */
+static gboolean line_joined(GUnicodeBreakType prev, GUnicodeBreakType cur,
+			    GUnicodeBreakType before_sp, gboolean zwj,
+			    gboolean cur_ri, int nri)
+{
+    if(cur == LB(MANDATORY) || cur == LB(CARRIAGE_RETURN) ||
+       cur == LB(LINE_FEED) || cur == LB(NEXT_LINE) ||
+       cur == LB(SPACE) || cur == LB(ZERO_WIDTH_SPACE))
+	return TRUE;
+    if(before_sp == LB(ZERO_WIDTH_SPACE))
+	return FALSE;
+    if(zwj)
+	return TRUE;
+    if(cur == LB(COMBINING_MARK)) {
+	if(prev != LB(SPACE))
+	    return TRUE;
+	cur = LB(ALPHABETIC);
+    }
+    if(cur == LB(WORD_JOINER) || prev == LB(WORD_JOINER) ||
+       prev == LB(NON_BREAKING_GLUE))
+	return TRUE;
+    if(cur == LB(NON_BREAKING_GLUE))
+	return prev != LB(SPACE) && prev != LB(AFTER) && prev != LB(HYPHEN);
+    if(cur == LB(CLOSE_PUNCTUATION) || cur == LB(CLOSE_PARANTHESIS) ||
+       cur == LB(EXCLAMATION) || cur == LB(INFIX_SEPARATOR) ||
+       cur == LB(SYMBOL))
+	return TRUE;
+    if(before_sp == LB(OPEN_PUNCTUATION) ||
+       (before_sp == LB(QUOTATION) && cur == LB(OPEN_PUNCTUATION)) ||
+       ((before_sp == LB(CLOSE_PUNCTUATION) ||
+	 before_sp == LB(CLOSE_PARANTHESIS)) && cur == LB(NON_STARTER)) ||
+       (before_sp == LB(BEFORE_AND_AFTER) && cur == LB(BEFORE_AND_AFTER)))
+	return TRUE;
+    if(prev == LB(SPACE))
+	return FALSE;
+    if(cur == LB(QUOTATION) || prev == LB(QUOTATION))
+	return TRUE;
+    if(cur == LB(CONTINGENT) || prev == LB(CONTINGENT))
+	return FALSE;
+    if(cur == LB(AFTER) || cur == LB(HYPHEN) || cur == LB(NON_STARTER) ||
+       prev == LB(BEFORE))
+	return TRUE;
+    if(prev == LB(SYMBOL) && cur == LB(HEBREW_LETTER))
+	return TRUE;
+    if(cur == LB(INSEPARABLE))
+	return TRUE;
+    switch(cur) {
+      case LB(ALPHABETIC):
+      case LB(HEBREW_LETTER):
+	return LB_ALNUM(prev) || prev == LB(PREFIX) ||
+	       prev == LB(POSTFIX) || prev == LB(INFIX_SEPARATOR) ||
+	       prev == LB(CLOSE_PARANTHESIS);
+      case LB(NUMERIC):
+	return LB_ALNUM(prev) || prev == LB(PREFIX) ||
+	       prev == LB(POSTFIX) || prev == LB(HYPHEN) ||
+	       prev == LB(INFIX_SEPARATOR) || prev == LB(SYMBOL) ||
+	       prev == LB(CLOSE_PARANTHESIS);
+      case LB(IDEOGRAPHIC):
+	return prev == LB(PREFIX);
+      case LB(PREFIX):
+      case LB(POSTFIX):
+	return prev == LB(ALPHABETIC) || prev == LB(HEBREW_LETTER) ||
+	       prev == LB(NUMERIC) || prev == LB(CLOSE_PUNCTUATION) ||
+	       prev == LB(CLOSE_PARANTHESIS) ||
+	       (cur == LB(POSTFIX) &&
+		(prev == LB(IDEOGRAPHIC) || LB_HANGUL(prev)));
+      case LB(OPEN_PUNCTUATION):
+	return LB_ALNUM(prev) || prev == LB(PREFIX) || prev == LB(POSTFIX);
+      case LB(HANGUL_L_JAMO):
+      case LB(HANGUL_LV_SYLLABLE):
+      case LB(HANGUL_LVT_SYLLABLE):
+	return prev == LB(HANGUL_L_JAMO) || prev == LB(PREFIX);
+      case LB(HANGUL_V_JAMO):
+	return prev == LB(HANGUL_L_JAMO) || prev == LB(HANGUL_V_JAMO) ||
+	       prev == LB(HANGUL_LV_SYLLABLE) || prev == LB(PREFIX);
+      case LB(HANGUL_T_JAMO):
+	return prev == LB(HANGUL_V_JAMO) || prev == LB(HANGUL_T_JAMO) ||
+	       prev == LB(HANGUL_LV_SYLLABLE) ||
+	       prev == LB(HANGUL_LVT_SYLLABLE) || prev == LB(PREFIX);
+      default:
+	return cur_ri && nri % 2;
+    }
+}
+
+/* return the end of the line break segment starting at i */
+static size_t line_end(const char *s, size_t sz, size_t i, gboolean *mandatory)
+{
+    gunichar c = utf8_next_char(s, sz, &i);
+    GUnicodeBreakType prev = line_class(c), cur, before_sp;
+    gboolean zwj = c == 0x200d;
+    int nri = is_regional_indicator(c);
+    if(prev == LB(COMBINING_MARK))
+	prev = LB(ALPHABETIC);
+    before_sp = prev;
+    while(i < sz) {
+	size_t j = i;
+	if(prev == LB(MANDATORY) || prev == LB(LINE_FEED) ||
+	   prev == LB(NEXT_LINE) || prev == LB(CARRIAGE_RETURN)) {
+	    if(prev != LB(CARRIAGE_RETURN) || s[i] != '\n')
+		break;
+	    i++;
+	    prev = LB(LINE_FEED);
+	    continue;
+	}
+	c = utf8_next_char(s, sz, &j);
+	cur = line_class(c);
+	if(!line_joined(prev, cur, before_sp, zwj, is_regional_indicator(c),
+			nri))
+	    break;
+	zwj = c == 0x200d;
+	i = j;
+	if(cur == LB(COMBINING_MARK)) {
+	    if(prev != LB(SPACE) && prev != LB(ZERO_WIDTH_SPACE))
+		continue;
+	    cur = LB(ALPHABETIC);
+	}
+	nri = is_regional_indicator(c) ? nri + 1 : 0;
+	if(cur != LB(SPACE))
+	    before_sp = cur;
+	prev = cur;
+    }
+    *mandatory = prev == LB(MANDATORY) || prev == LB(LINE_FEED) ||
+		 prev == LB(NEXT_LINE) || prev == LB(CARRIAGE_RETURN);
+    return i;
+}
+
+#undef LB_HANGUL
+#undef LB_ALNUM
+#undef LB
+
+static int utf8_segments_next(lua_State *L)
+{
+    size_t sz, i, e;
+    const char *s = lua_tolstring(L, lua_upvalueindex(1), &sz);
+    int what = lua_tonumber(L, lua_upvalueindex(2));
+    gboolean flag = FALSE;
+
+    i = lua_tonumber(L, lua_upvalueindex(3));
+    if(i >= sz)
+	return 0;
+    switch(what) {
+      case 0: e = grapheme_end(s, sz, i); break;
+      case 1: e = word_end(s, sz, i, &flag); break;
+      default: e = line_end(s, sz, i, &flag); break;
+    }
+    lua_pushnumber(L, e);
+    lua_replace(L, lua_upvalueindex(3));
+    lua_pushnumber(L, i + 1);
+    lua_pushnumber(L, e);
+    if(!what)
+	return 2;
+    lua_pushboolean(L, flag);
+    return 3;
+}
+
+/***
+Iterate over grapheme clusters, words or line break opportunities.
+The boundaries are found in C, using GLib's Unicode character tables
+to approximate the rules of UAX #29 (grapheme clusters and words) and
+UAX #14 (lines).  Each step returns the byte range of one segment, so
+`s:sub(first, last)` is the segment's text.  Invalid UTF-8 bytes are
+treated as individual U+FFFD characters.
+@function utf8_segments
+@tparam string s The utf-8-encoded string
+@tparam[opt] string what The type of segment:  `grapheme` (the default),
+ `word` or `line`.  Word segments include runs of spaces and punctuation
+ between the words; line segments include trailing spaces.
+@treturn function An iterator which returns the first and last byte
+ position of the next segment.  For `word`, a third return value is true
+ if the segment is a word (starts with a letter, number or underscore).
+ For `line`, it is true if the segment ends with a mandatory break (a
+ newline).
+@usage
+for first, last, isword in glib.utf8_segments(s, 'word') do
+  if isword then print(s:sub(first, last)) end
+end
+*/
+static int glib_utf8_segments(lua_State *L)
+{
+    static const char *const what_opts[] = {
+	"grapheme", "word", "line", NULL
+    };
+    int what;
+    luaL_checkstring(L, 1);
+    what = luaL_checkoption(L, 2, "grapheme", what_opts);
+    lua_settop(L, 1);
+    lua_pushnumber(L, what);
+    lua_pushnumber(L, 0);
+    lua_pushcclosure(L, utf8_segments_next, 3);
+    return 1;
+}
+
 /***
 Obtain a substring of a utf-8-encoded string.
 This is not a wrapper for `g_utf8_substring()`, but instead code which
@@ -1018,15 +2566,15 @@ refer to code points rather than byte offsets.
 @treturn string The requested substring.  Out-of-bound ranges result in an
  empty string.
 */
-static int glib_utf8_sub(lua_State *L)
+/* convert string.sub-style code point range at args arg, arg + 1 */
+/* to 0-based first and last; returns FALSE if range is empty */
+static gboolean utf8_sub_range(lua_State *L, int arg, size_t ul,
+			       size_t *firstp, size_t *lastp)
 {
-    size_t sz, ul;
-    const char *s = luaL_checklstring(L, 1, &sz), *sub, *sube;
     int narg = lua_gettop(L);
     lua_Integer first, last;
-    ul = g_utf8_strlen(s, sz);
-    if(narg > 1)
-	first = luaL_checkinteger(L, 2);
+    if(narg >= arg)
+	first = luaL_checkinteger(L, arg);
     else
 	first = 1;
     if(first < 0)
@@ -1035,8 +2583,8 @@ static int glib_utf8_sub(lua_State *L)
 	first = 1;
     if(first > ul)
 	first = ul;
-    if(narg > 2)
-	last = luaL_checkinteger(L, 3);
+    if(narg > arg)
+	last = luaL_checkinteger(L, arg + 1);
     else
 	last = ul;
     if(last < 0)
@@ -1045,12 +2593,24 @@ static int glib_utf8_sub(lua_State *L)
 	last = 1;
     if(last > ul)
 	last = ul;
-    if(last < first || !ul) {
+    if(last < first || !ul)
+	return FALSE;
+    *firstp = first - 1;
+    *lastp = last - 1;
+    return TRUE;
+}
+
+static int glib_utf8_sub(lua_State *L)
+{
+    size_t sz, ul, first, last;
+    const char *s = luaL_checklstring(L, 1, &sz), *sub, *sube;
+    ul = utf8_strlen(s, sz);
+    if(!utf8_sub_range(L, 2, ul, &first, &last)) {
 	lua_pushliteral(L, "");
 	return 1;
     }
-    sub = g_utf8_offset_to_pointer(s, first - 1);
-    if(last != ul)
+    sub = g_utf8_offset_to_pointer(s, first);
+    if(last != ul - 1)
 	sube = g_utf8_offset_to_pointer(sub, last - first + 1);
     else
 	sube = s + sz;
@@ -1069,85 +2629,625 @@ static int glib_utf8_len(lua_State *L)
 {
     size_t sz, ul;
     const char *s = luaL_checklstring(L, 1, &sz);
-    ul = g_utf8_strlen(s, sz);
+    ul = utf8_strlen(s, sz);
     lua_pushnumber(L, ul);
     return 1;
 }
 
-/***
-Check if a string is valid UTF-8.
-This is a wrapper for `g_utf8_validate()`.
-@function utf8_validate
-@tparam string s The string
-@treturn boolean True if *s* is valid UTF-8.
-*/
-static int glib_utf8_validate(lua_State *L)
+typedef struct utf8_window_state {
+    GString pend; /* start of the current window */
+    size_t n; /* code points per window */
+    size_t count; /* complete code points in pend */
+    int need; /* bytes still missing from the last code point in pend */
+} utf8_window_state;
+
+static int free_utf8_window_state(lua_State *L)
 {
-    size_t sz;
-    const char *s = luaL_checklstring(L, 1, &sz), *e;
-    gboolean v = g_utf8_validate(s, sz, &e);
-    lua_pushboolean(L, v);
-    if(!v) {
-	lua_pushlstring(L, e, sz - (int)(e - s));
-	return 2;
+    get_udata(L, 1, st, utf8_window_state);
+    if(st->pend.str) {
+	g_free(st->pend.str);
+	st->pend.str = NULL;
     }
-    return 1;
+    return 0;
 }
 
-#define uni_str(n) \
-static int glib_##n(lua_State *L) \
-{ \
-    size_t sz; \
-    const char *s = luaL_checklstring(L, 1, &sz); \
-    char *ret = g_##n(s, sz); \
-    lua_pushstring(L, ret); \
-    g_free(ret); \
-    return 1; \
+/***
+Stream windowing function returned by `utf8_window`.
+This function is returned by `utf8_window` to split a stream of UTF-8
+text into pieces with a fixed number of code points.  Call it with each
+piece of the stream; it returns the windows completed by that piece.
+Characters split across pieces are carried over to the next call.  When
+finished with the stream, call with a `nil` or absent *s*.  This will
+return the final, short window (if any) in the same way, and reset the
+function for reuse.
+Code points are counted the same way as `utf8_len` and `utf8_sub`, so
+windows of valid input match `utf8_sub(s, i, i + n - 1)`.
+@function _utf8_window_
+@see utf8_window
+@tparam[opt] string s The next piece of the stream; absent or `nil`
+ to finish
+@tparam[optchain] table t The table to fill with windows.  If not
+ supplied, a new table is returned.  Any previous contents starting at
+ index 1 are replaced, and the entry after the last window is set to `nil`.
+@treturn {string,...} The completed windows, in order.  When finishing,
+ this contains the final window, if any.
+@treturn number The number of windows returned
+*/
+static int stream_utf8_window(lua_State *L)
+{
+    size_t sz, i = 0, start = 0, r;
+    const char *s;
+    int nw = 0;
+    get_udata(L, lua_upvalueindex(1), st, utf8_window_state);
+
+    if(!lua_isnoneornil(L, 2))
+	luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    if(lua_isnil(L, 2)) {
+	lua_newtable(L);
+	lua_replace(L, 2);
+    }
+    if(lua_isnil(L, 1)) {
+	if(st->pend.len) {
+	    lua_pushlstring(L, st->pend.str, st->pend.len);
+	    lua_rawseti(L, 2, ++nw);
+	    g_string_truncate(&st->pend, 0);
+	}
+	st->count = 0;
+	st->need = 0;
+	lua_pushnil(L);
+	lua_rawseti(L, 2, nw + 1);
+	lua_pushnumber(L, nw);
+	return 2;
+    }
+    s = luaL_checklstring(L, 1, &sz);
+    while(i < sz) {
+	if(st->need) {
+	    r = MIN(st->need, sz - i);
+	    st->need -= r;
+	    i += r;
+	    if(!st->need)
+		st->count++;
+	} else {
+	    /* skip ASCII a block at a time; it is always one byte per char */
+	    r = ascii_prefix(s + i, MIN(sz - i, st->n - st->count));
+	    i += r;
+	    st->count += r;
+	    if(st->count < st->n && i < sz) {
+		int k = g_utf8_skip[(guchar)s[i]];
+		if(k > sz - i) {
+		    st->need = k - (sz - i);
+		    i = sz;
+		} else {
+		    i += k;
+		    st->count++;
+		}
+	    }
+	}
+	if(st->count == st->n) {
+	    if(st->pend.len) {
+		g_string_append_len(&st->pend, s + start, i - start);
+		lua_pushlstring(L, st->pend.str, st->pend.len);
+		g_string_truncate(&st->pend, 0);
+	    } else
+		lua_pushlstring(L, s + start, i - start);
+	    lua_rawseti(L, 2, ++nw);
+	    st->count = 0;
+	    start = i;
+	}
+    }
+    if(i > start)
+	g_string_append_len(&st->pend, s + start, i - start);
+    lua_pushnil(L);
+    lua_rawseti(L, 2, nw + 1);
+    lua_pushnumber(L, nw);
+    return 2;
 }
 
 /***
-Convert UTF-8 string to upper-case.
-This is a wrapper for `g_utf8_strup()`.
-@function utf8_strup
-@tparam string s The source string
-@treturn string *s*, with all lower-case characters converted to upper-case
-*/
-uni_str(utf8_strup)
-/***
-Convert UTF-8 string to lower-case.
-This is a wrapper for `g_utf8_strdown()`.
-@function utf8_strdown
-@tparam string s The source string
-@treturn string *s*, with all upper-case characters converted to lower-case
-*/
-uni_str(utf8_strdown)
-/***
-Convert UTF-8 string to case-independent form.
-This is a wrapper for `g_utf8_casefold()`.
-@function utf8_casefold
-@tparam string s The source string
-@treturn string *s*, in a form that is suitable for case-insensitive direct
- string comparison.
+Split a stream of UTF-8 text into fixed-size code point windows.
+This returns a function which accepts successive pieces of a stream,
+such as the output of a `_convert_` function, and returns its contents
+split into windows of *n* code points.  Only the current, incomplete
+window is held between calls.
+@function utf8_window
+@see _utf8_window_
+@tparam number n The number of code points per window
+@treturn function The stream windowing function (`_utf8_window_`)
+@usage
+conv = glib.convert(nil, 'utf-8', 'latin1')
+win = glib.utf8_window(80)
+function feed(s, msg)
+  if not s then error(msg) end
+  for _, rec in ipairs(win(s)) do process(rec) end
+end
+for piece in f:lines(4096) do feed(conv(piece)) end
+feed(conv()) -- the converter's final output
+for _, rec in ipairs(win()) do process(rec) end -- the final, short window
 */
-uni_str(utf8_casefold)
-
-/***
-Perform standard Unicode normalization on a UTF-8 string.
-This is a wrapper for `g_utf8_normalize()`.  The four standard
+static int glib_utf8_window(lua_State *L)
+{
+    lua_Integer n = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, n > 0, 1, "window size must be positive");
+    {
+	alloc_udata(L, st, utf8_window_state);
+	st->n = n;
+	lua_pushcclosure(L, stream_utf8_window, 1);
+    }
+    return 1;
+}
+
+typedef struct utf8_valid_state {
+    lua_Number pos; /* bytes validated so far */
+    lua_Number bad; /* position of first invalid sequence, or 0 */
+    char pend[4]; /* incomplete character at end of last chunk */
+    int npend;
+} utf8_valid_state;
+
+/* validate one piece of a stream; sets st->bad on error */
+static void utf8_valid_chunk(utf8_valid_state *st, const char *s, size_t sz)
+{
+    const char *e;
+    gunichar ch;
+
+    if(st->npend) {
+	/* complete the pending character first */
+	char buf[8];
+	size_t n = MIN(sz, 4 - st->npend), len;
+	memcpy(buf, st->pend, st->npend);
+	memcpy(buf + st->npend, s, n);
+	ch = g_utf8_get_char_validated(buf, st->npend + n);
+	if(ch == (gunichar)-2 && st->npend + n < 4 && n == sz) {
+	    memcpy(st->pend + st->npend, s, n);
+	    st->npend += n;
+	    return;
+	}
+	if(ch == (gunichar)-1 || ch == (gunichar)-2) {
+	    st->bad = st->pos + 1;
+	    return;
+	}
+	len = g_utf8_skip[(guchar)buf[0]];
+	st->pos += len;
+	s += len - st->npend;
+	sz -= len - st->npend;
+	st->npend = 0;
+    }
+    if(utf8_validate(s, sz, &e)) {
+	st->pos += sz;
+	return;
+    }
+    st->pos += e - s;
+    sz -= e - s;
+    ch = g_utf8_get_char_validated(e, sz);
+    if(ch == (gunichar)-2 && sz < 4) {
+	memcpy(st->pend, e, sz);
+	st->npend = sz;
+    } else
+	st->bad = st->pos + 1;
+}
+
+/***
+Stream UTF-8 validation function returned by `utf8_validate`.
+This function is returned by `utf8_validate` to support validating
+streams piecewise, without keeping the whole stream in memory.
+Simply call with string arguments, and finally call with no
+arguments to check that the stream did not end in the middle of a
+character.  Characters may be split across pieces.  After finishing, the
+validator is reset and may be used for another stream.
+@function _utf8_validate_
+@see utf8_validate
+@tparam[opt] string s The next piece of the stream; absent or `nil` to
+ finish validation
+@treturn boolean True if the stream is valid UTF-8 so far (or, when
+ finishing, in its entirety).
+@treturn number If not valid, the position of the first invalid byte
+ sequence, counted in bytes from the start of the stream (starting at 1).
+ Once an invalid sequence is found, all further pieces are ignored.
+@usage
+v = glib.utf8_validate()
+while true do
+  buf = inf:read(4096)
+  if not buf then break end
+  if not v(buf) then break end
+end
+ok, pos = v()
+*/
+static int stream_utf8_validate(lua_State *L)
+{
+    lua_Number bad;
+    get_udata(L, lua_upvalueindex(1), st, utf8_valid_state);
+    if(!lua_isnoneornil(L, 1)) {
+	size_t sz;
+	const char *s = luaL_checklstring(L, 1, &sz);
+	if(!st->bad)
+	    utf8_valid_chunk(st, s, sz);
+	bad = st->bad;
+    } else {
+	bad = st->bad ? st->bad : st->npend ? st->pos + 1 : 0;
+	memset(st, 0, sizeof(*st));
+    }
+    lua_pushboolean(L, !bad);
+    if(!bad)
+	return 1;
+    lua_pushnumber(L, bad);
+    return 2;
+}
+
+/***
+Check if a string is valid UTF-8.
+This is a wrapper for `g_utf8_validate()`, using a vectorized scan
+where possible.
+@function utf8_validate
+@see _utf8_validate_
+@tparam[opt] string s The string.  If absent, return a function like
+ `_utf8_validate_` to validate a stream piecewise.
+@treturn boolean|function True if *s* is valid UTF-8, or a stream
+ validation function.
+@treturn string If *s* is not valid, the remainder of *s* starting
+ with the first invalid byte sequence.
+*/
+static int glib_utf8_validate(lua_State *L)
+{
+    size_t sz;
+    const char *s, *e;
+    gboolean v;
+    if(lua_gettop(L) == 0) {
+	alloc_udata(L, st, utf8_valid_state);
+	lua_pushcclosure(L, stream_utf8_validate, 1);
+	return 1;
+    }
+    s = luaL_checklstring(L, 1, &sz);
+    v = utf8_validate(s, sz, &e);
+    lua_pushboolean(L, v);
+    if(!v) {
+	lua_pushlstring(L, e, sz - (int)(e - s));
+	return 2;
+    }
+    return 1;
+}
+
+#define uni_str(n) \
+static int glib_##n(lua_State *L) \
+{ \
+    size_t sz; \
+    const char *s = luaL_checklstring(L, 1, &sz); \
+    char *ret = g_##n(s, sz); \
+    lua_pushstring(L, ret); \
+    g_free(ret); \
+    return 1; \
+}
+
+/* GLib maps i and I specially in Turkish and Azeri locales */
+static gboolean turkic_locale(void)
+{
+    const char *loc = setlocale(LC_CTYPE, NULL);
+    return loc && (!g_ascii_strncasecmp(loc, "tr", 2) ||
+		   !g_ascii_strncasecmp(loc, "az", 2));
+}
+
+/* case map s using f, mapping ASCII letters lo .. lo + 25 directly */
+/* returns s itself if nothing changes */
+static int case_map(lua_State *L, gchar *(*f)(const gchar *, gssize),
+		    char lo, gboolean locale_sensitive)
+{
+    size_t sz, n, e, g, rlen;
+    const char *s = luaL_checklstring(L, 1, &sz);
+    char *d = NULL, *ret;
+
+    /* GLib stops at NUL */
+    if(memchr(s, 0, sz) || (locale_sensitive && turkic_locale())) {
+	ret = f(s, sz);
+	lua_pushstring(L, ret);
+	g_free(ret);
+	return 1;
+    }
+    n = ascii_case_span(s, sz, lo);
+    if(n == sz) {
+	lua_pushvalue(L, 1);
+	return 1;
+    }
+    e = n;
+    if(!(s[n] & 0x80)) {
+	d = g_malloc(sz);
+	memcpy(d, s, n);
+	e += ascii_case_map(s + n, d + n, sz - n, lo);
+	if(e == sz) {
+	    lua_pushlstring(L, d, sz);
+	    g_free(d);
+	    return 1;
+	}
+    }
+    /* the rest is done by GLib, starting with the last ASCII char, since */
+    /* mapping of some characters depends on their neighbors */
+    g = e ? e - 1 : 0;
+    ret = f(s + g, sz - g);
+    rlen = strlen(ret);
+    if(!d && rlen == sz - g && !memcmp(ret, s + g, rlen)) {
+	g_free(ret);
+	lua_pushvalue(L, 1);
+	return 1;
+    }
+    if(!d) {
+	d = g_malloc(g + rlen);
+	memcpy(d, s, g);
+    } else if(rlen > sz - g)
+	d = g_realloc(d, g + rlen);
+    memcpy(d + g, ret, rlen);
+    g_free(ret);
+    lua_pushlstring(L, d, g + rlen);
+    g_free(d);
+    return 1;
+}
+
+/***
+Convert UTF-8 string to upper-case.
+This is a wrapper for `g_utf8_strup()`.  ASCII text is mapped directly,
+and if nothing needs to be changed, *s* itself is returned.
+@function utf8_strup
+@tparam string s The source string
+@treturn string *s*, with all lower-case characters converted to upper-case
+*/
+static int glib_utf8_strup(lua_State *L)
+{
+    return case_map(L, g_utf8_strup, 'a', TRUE);
+}
+
+/***
+Convert UTF-8 string to lower-case.
+This is a wrapper for `g_utf8_strdown()`.  ASCII text is mapped directly,
+and if nothing needs to be changed, *s* itself is returned.
+@function utf8_strdown
+@tparam string s The source string
+@treturn string *s*, with all upper-case characters converted to lower-case
+*/
+static int glib_utf8_strdown(lua_State *L)
+{
+    return case_map(L, g_utf8_strdown, 'A', TRUE);
+}
+
+/***
+Convert UTF-8 string to case-independent form.
+This is a wrapper for `g_utf8_casefold()`.  ASCII text is mapped directly,
+and if nothing needs to be changed, *s* itself is returned.
+@function utf8_casefold
+@tparam string s The source string
+@treturn string *s*, in a form that is suitable for case-insensitive direct
+ string comparison.
+*/
+static int glib_utf8_casefold(lua_State *L)
+{
+    return case_map(L, g_utf8_casefold, 'A', FALSE);
+}
+
+#if GLIB_CHECK_VERSION(2, 30, 0)
+/* Characters which may compose with the character before them, i.e. those */
+/* with the Unicode NFC_Quick_Check property Maybe.  Splitting text before */
+/* any of these, or before a non-starter, might change its normalization */
+static const gunichar nfc_qc_maybe[][2] = {
+    {0x0300, 0x0304}, {0x0306, 0x030C}, {0x030F, 0x030F}, {0x0311, 0x0311},
+    {0x0313, 0x0314}, {0x031B, 0x031B}, {0x0323, 0x0328}, {0x032D, 0x032E},
+    {0x0330, 0x0331}, {0x0338, 0x0338}, {0x0342, 0x0342}, {0x0345, 0x0345},
+    {0x0653, 0x0655}, {0x093C, 0x093C}, {0x09BE, 0x09BE}, {0x09D7, 0x09D7},
+    {0x0B3E, 0x0B3E}, {0x0B56, 0x0B57}, {0x0BBE, 0x0BBE}, {0x0BD7, 0x0BD7},
+    {0x0C56, 0x0C56}, {0x0CC2, 0x0CC2}, {0x0CD5, 0x0CD6}, {0x0D3E, 0x0D3E},
+    {0x0D57, 0x0D57}, {0x0DCA, 0x0DCA}, {0x0DCF, 0x0DCF}, {0x0DDF, 0x0DDF},
+    {0x102E, 0x102E}, {0x1161, 0x1175}, {0x11A8, 0x11C2}, {0x1B35, 0x1B35},
+    {0x3099, 0x309A}, {0x110BA, 0x110BA}, {0x11127, 0x11127},
+    {0x1133E, 0x1133E}, {0x11357, 0x11357}, {0x114B0, 0x114B0},
+    {0x114BA, 0x114BA}, {0x114BD, 0x114BD}, {0x115AF, 0x115AF},
+    {0x11930, 0x11930}
+};
+
+static gboolean nfc_maybe(gunichar c)
+{
+    int l = 0, h = G_N_ELEMENTS(nfc_qc_maybe) - 1;
+    while(l <= h) {
+	int m = (l + h) / 2;
+	if(c < nfc_qc_maybe[m][0])
+	    h = m - 1;
+	else if(c > nfc_qc_maybe[m][1])
+	    l = m + 1;
+	else
+	    return TRUE;
+    }
+    return FALSE;
+}
+
+/* return 1 if normalization of text may be split before c, and */
+/* 2 if in addition c is already normalized (and so needs no work) */
+static int norm_boundary(gunichar c, GNormalizeMode nm)
+{
+    gunichar d[G_UNICHAR_MAX_DECOMPOSITION_LENGTH];
+    gboolean compat = nm == G_NORMALIZE_NFKC || nm == G_NORMALIZE_NFKD;
+    gsize n;
+
+    if(c < 0x80)
+	return 2;
+    if(g_unichar_combining_class(c) || nfc_maybe(c))
+	return 0;
+    n = g_unichar_fully_decompose(c, compat, d, G_N_ELEMENTS(d));
+    if(n == 1 && d[0] == c)
+	return 2;
+    if(g_unichar_combining_class(d[0]) || nfc_maybe(d[0]))
+	return 0;
+    /* precomposed Latin and Hangul syllables are left alone by NFC */
+    if(nm == G_NORMALIZE_NFC && (c < 0x250 || (c >= 0xAC00 && c <= 0xD7A3)))
+	return 2;
+    return 1;
+}
+
+/* like g_utf8_get_char_validated(), but NUL is an ordinary character */
+static gunichar norm_get_char(const char *s, size_t len)
+{
+    return *s ? g_utf8_get_char_validated(s, len) : 0;
+}
+
+/* normalize s into B, skipping runs of characters needing no work */
+/* if !final, stop at the last boundary; returns bytes consumed, or -1 */
+/* if s is not valid UTF-8 */
+static gssize normalize_buf(luaL_Buffer *B, const char *s, size_t len,
+			    GNormalizeMode nm, gboolean final)
+{
+    size_t i = 0, done = 0, seg = 0, end = len;
+    gunichar c;
+
+    if(!final) {
+	/* find last boundary; anything after it may change */
+	end = 0;
+	for(i = len; i > 0; ) {
+	    size_t p = i - 1;
+	    while(p > 0 && i - p < 4 && (s[p] & 0xc0) == 0x80)
+		p--;
+	    c = norm_get_char(s + p, len - p);
+	    if(c == (gunichar)-1)
+		return -1;
+	    if(c != (gunichar)-2 && norm_boundary(c, nm)) {
+		end = p;
+		break;
+	    }
+	    i = p;
+	}
+	i = 0;
+    }
+    while(i < end) {
+	size_t run = ascii_prefix(s + i, end - i);
+	int b;
+	gchar *ret;
+	if(run) {
+	    i += run;
+	    seg = i - 1;
+	    continue;
+	}
+	c = norm_get_char(s + i, end - i);
+	if(c == (gunichar)-1 || c == (gunichar)-2)
+	    return -1;
+	b = norm_boundary(c, nm);
+	if(b) {
+	    seg = i;
+	    i += g_utf8_skip[(guchar)s[i]];
+	    if(b == 2)
+		continue;
+	}
+	/* normalize from the last boundary to the next */
+	while(i < end) {
+	    c = norm_get_char(s + i, end - i);
+	    if(c == (gunichar)-1 || c == (gunichar)-2)
+		return -1;
+	    if(norm_boundary(c, nm))
+		break;
+	    i += g_utf8_skip[(guchar)s[i]];
+	}
+	luaL_addlstring(B, s + done, seg - done);
+	/* g_utf8_normalize() stops at NUL */
+	if(!s[seg])
+	    luaL_addlstring(B, s + seg++, 1);
+	ret = g_utf8_normalize(s + seg, i - seg, nm);
+	if(!ret)
+	    return -1;
+	luaL_addstring(B, ret);
+	g_free(ret);
+	done = i;
+    }
+    luaL_addlstring(B, s + done, end - done);
+    return end;
+}
+
+typedef struct normalize_state {
+    GString pend; /* input since the last boundary */
+    GNormalizeMode mode;
+} normalize_state;
+
+static int free_normalize_state(lua_State *L)
+{
+    get_udata(L, 1, st, normalize_state);
+    if(st->pend.str) {
+	g_free(st->pend.str);
+	st->pend.str = NULL;
+    }
+    return 0;
+}
+
+/***
+Stream normalization function returned by `utf8_normalize`.
+This function is returned by `utf8_normalize` to support normalizing
+streams piecewise.  Simply call with string arguments, accumulating
+the returned strings.  When finished with the stream, call with no
+arguments.  This will return the final string to append and reset the
+normalizer for reuse.  Only the text after the last point at which
+normalization can safely be split is held back between calls, so memory
+use is proportional to the size of the pieces rather than the stream.
+Unlike `utf8_normalize` with a string argument, embedded NUL characters
+do not end the output; they are passed through unchanged.
+
+This is only available with GLib 2.30 or later.
+@function _utf8_normalize_
+@see utf8_normalize
+@tparam[opt] string s The next piece of the string to normalize; absent or
+ `nil` to finish
+@treturn string The next piece of the normalized string
+@raise Returns `nil` and an error message if the input is not valid
+ UTF-8.  The stream is reset in that case.
+*/
+static int stream_utf8_normalize(lua_State *L)
+{
+    size_t sz = 0;
+    const char *s = NULL;
+    luaL_Buffer B;
+    gssize n;
+    gboolean final = lua_isnoneornil(L, 1);
+    get_udata(L, lua_upvalueindex(1), st, normalize_state);
+    if(!final)
+	s = luaL_checklstring(L, 1, &sz);
+    if(st->pend.len) {
+	if(s)
+	    g_string_append_len(&st->pend, s, sz);
+	s = st->pend.str;
+	sz = st->pend.len;
+    }
+    luaL_buffinit(L, &B);
+    n = s ? normalize_buf(&B, s, sz, st->mode, final) : 0;
+    if(n < 0 || final) {
+	if(st->pend.len)
+	    g_string_truncate(&st->pend, 0);
+	if(n < 0) {
+	    lua_pushnil(L);
+	    lua_pushliteral(L, "Invalid utf-8");
+	    return 2;
+	}
+    } else if(st->pend.len)
+	g_string_erase(&st->pend, 0, n);
+    else
+	g_string_append_len(&st->pend, s + n, sz - n);
+    luaL_pushresult(&B);
+    return 1;
+}
+#endif
+
+/***
+Perform standard Unicode normalization on a UTF-8 string.
+This is a wrapper for `g_utf8_normalize()`.  The four standard
 normalizations are NFD (the default), NFC (compose), NFKD (compatible),
-and NFKC (compose, compatible).
+and NFKC (compose, compatible).  With GLib 2.30 or later, runs of
+characters which are already normalized (such as ASCII text) are copied
+without calling `g_utf8_normalize()`.  As with `g_utf8_normalize()`,
+the result ends at the first NUL character in *s*; the streaming
+normalizer, on the other hand, passes NUL characters through.
 @function utf8_normalize
-@tparam string s The string to normalize
-@tparam[opt] boolean compose If true, perform canonical composition.
+@see _utf8_normalize_
+@tparam[opt] string s The string to normalize, or `nil`/absent to produce
+ a streaming normalizer (GLib 2.30 or later)
+@tparam[optchain] boolean compose If true, perform canonical composition.
  Otherwise, leave in decomposed form.
 @tparam[optchain] boolean compatible If true, decompose using compatibility
  decompostions.  Otherwise, only decompose using canonical decompositions.
-@treturn string The normalized UTF-8 string.
+@treturn string|function The normalized UTF-8 string, or a stream
+ normalizer function
+@raise Returns `nil` and an error message if *s* is not valid UTF-8.
 */
 static int glib_utf8_normalize(lua_State *L)
 {
     size_t sz;
-    const char *s = luaL_checklstring(L, 1, &sz);
+    const char *s;
     char *ret;
     int docomp = lua_toboolean(L, 2);
     int docompat = lua_toboolean(L, 3);
@@ -1156,6 +3256,29 @@ static int glib_utf8_normalize(lua_State *L)
 	nm = docompat ? G_NORMALIZE_NFKC : G_NORMALIZE_NFC;
     else
 	nm = docompat ? G_NORMALIZE_NFKD : G_NORMALIZE_NFD;
+#if GLIB_CHECK_VERSION(2, 30, 0)
+    if(lua_isnoneornil(L, 1)) {
+	alloc_udata(L, st, normalize_state);
+	st->mode = nm;
+	lua_pushcclosure(L, stream_utf8_normalize, 1);
+	return 1;
+    }
+#endif
+    s = luaL_checklstring(L, 1, &sz);
+#if GLIB_CHECK_VERSION(2, 30, 0)
+    /* g_utf8_normalize() truncates at the first NUL; keep doing so */
+    if(!memchr(s, 0, sz)) {
+	luaL_Buffer B;
+	luaL_buffinit(L, &B);
+	if(normalize_buf(&B, s, sz, nm, TRUE) < 0) {
+	    lua_pushnil(L);
+	    lua_pushliteral(L, "Invalid utf-8");
+	    return 2;
+	}
+	luaL_pushresult(&B);
+	return 1;
+    }
+#endif
     ret = g_utf8_normalize(s, sz, nm);
     if(!ret) {
 	lua_pushnil(L);
@@ -1306,96 +3429,652 @@ static int glib_to_utf8(lua_State *L)
     return 1;
 }
 
-/*********************************************************************/
-/***
-Base64 Encoding
-@section Base64 Encoding
-*/
+/* code points between byte offset checkpoints in utf8_index */
+#define UTF8_INDEX_STEP 64
 
-#define B64_ENCCHUNK 80
-#define B64_BUFSIZE_NCR ((B64_ENCCHUNK/3+1)*4+4)
-#define B64_BUFSIZE (B64_BUFSIZE_NCR + B64_BUFSIZE_NCR/72 + 1)
-#define B64_DECCHUNK ((B64_BUFSIZE-3)/3*4)
+typedef struct utf8_index_state {
+    const char *s; /* kept alive by the user value */
+    size_t sz, len; /* length in bytes, code points */
+    size_t *cp; /* byte offset of every UTF8_INDEX_STEP-th code point */
+} utf8_index_state;
 
-typedef struct base64_state {
-    gint state, save;
-    char obuf[B64_BUFSIZE];
-} base64_state;
+static int free_utf8_index_state(lua_State *L)
+{
+    get_udata(L, 1, st, utf8_index_state);
+    if(st->cp) {
+	g_free(st->cp);
+	st->cp = NULL;
+    }
+    return 0;
+}
 
 /***
-Stream Base64-encoding function returned by `base64_encode`.
-This function is returned by `base64_encode` to support
-piecewise-encoding streams.  Simply call with string arguments,
-accumulating the returned strings.  When finished with the stream,
-call with no arguments.  This will return the final string to
-append and reset the stream for reuse.
-@function _base64_encode_
-@see base64_encode
-@tparam[opt] string s The next piece of the string to convert; absent
- to finish conversion
-@treturn string The next piece of the converted string
-@usage
-enc = glib.base64_encode()
-while true do
-  buf = inf:read(4096)
-  if not buf then break end
-  outf:write(enc(buf))
-end
-outf:write(enc())
+Create a code point index for a UTF-8 string.
+Functions such as `utf8_sub` and `utf8_len` must scan the string from
+the start every time they are called.  The returned index instead
+records the byte offset of every 64th code point, so that finding any
+position in the string only requires scanning at most 63 characters.
+Pure ASCII strings need no table at all.  Use this when taking many
+substrings of the same large string.
+
+Unlike `utf8_len`, code points are counted to the end of the string,
+even past embedded NUL characters.  An incomplete character at the end
+of the string is not counted.  The string itself is not validated.
+@function utf8_index
+@tparam string s The utf-8-encoded string to index
+@treturn utf8_index The index of *s*
 */
-static int stream_base64_encode(lua_State *L)
+static int glib_utf8_index(lua_State *L)
 {
-    size_t sz;
-    const char *s;
-
-    get_udata(L, lua_upvalueindex(1), st, base64_state);
-    if(lua_isnoneornil(L, 1)) {
-	sz = g_base64_encode_close(0, st->obuf, &st->state, &st->save);
-	lua_pushlstring(L, st->obuf, sz);
-	memset(st, 0, sizeof(*st));
+    size_t sz, pos, n, run, len = 0;
+    const char *s = luaL_checklstring(L, 1, &sz);
+    alloc_udata(L, st, utf8_index_state);
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_setuservalue(L, -2);
+    st->s = s;
+    st->sz = sz;
+    pos = ascii_prefix(s, sz);
+    if(pos == sz) {
+	st->len = sz;
 	return 1;
     }
-    s = luaL_checklstring(L, 1, &sz);
-    lua_pushliteral(L, "");
-    while(sz > 0) {
-	int encsz = sz > B64_ENCCHUNK ? B64_ENCCHUNK : sz, retsz;
-	retsz = g_base64_encode_step((const guchar *)s, encsz, 0, st->obuf,
-				     &st->state, &st->save);
-	if(retsz) {
-	    lua_pushlstring(L, st->obuf, retsz);
-	    lua_concat(L, 2);
-	}
-	sz -= encsz;
-	s += encsz;
+    /* at most one checkpoint per UTF8_INDEX_STEP bytes */
+    st->cp = g_new(size_t, sz / UTF8_INDEX_STEP + 1);
+    for(n = 0; n <= pos; n += UTF8_INDEX_STEP)
+	st->cp[n / UTF8_INDEX_STEP] = n;
+    len = pos;
+    while(1) {
+	/* non-ASCII char at pos, followed by an ASCII run */
+	if(!(len % UTF8_INDEX_STEP))
+	    st->cp[len / UTF8_INDEX_STEP] = pos;
+	pos += g_utf8_skip[(guchar)s[pos]];
+	if(pos > sz)
+	    break;
+	len++;
+	if(pos == sz)
+	    break;
+	run = ascii_prefix(s + pos, sz - pos);
+	/* first checkpoint at or after len */
+	for(n = (len + UTF8_INDEX_STEP - 1) / UTF8_INDEX_STEP * UTF8_INDEX_STEP;
+	    n < len + run; n += UTF8_INDEX_STEP)
+	    st->cp[n / UTF8_INDEX_STEP] = pos + n - len;
+	pos += run;
+	len += run;
+	if(pos == sz)
+	    break;
     }
+    st->len = len;
     return 1;
 }
 
-/***
-Base64-encode a string.
-This is a wrapper for `g_base64_encode()` and friends.
-@function base64_encode
-@see _base64_encode_
-@tparam[opt] string s The data to encode.  If absent, return a function
- like `_base64_encode_` for encoding a stream.
-@treturn string|function The base64-encoded stream (without newlines), or a
- function to do the same on a stream.
-*/
-static int glib_base64_encode(lua_State *L)
+/* byte offset of 0-based code point n (n <= st->len) */
+static size_t utf8_index_pos(utf8_index_state *st, size_t n)
 {
-    size_t sz;
-    const char *s;
-    char *ret;
-    if(lua_gettop(L) == 0) {
-	alloc_udata(L, st, base64_state);
-	lua_pushcclosure(L, stream_base64_encode, 1);
-	return 1;
-    }
-    s = luaL_checklstring(L, 1, &sz);
-    ret = g_base64_encode((const guchar *)s, sz);
-    lua_pushstring(L, ret);
-    g_free(ret);
-    return 1;
+    size_t pos;
+    if(!st->cp || n == st->len)
+	return n == st->len ? st->sz : n;
+    pos = st->cp[n / UTF8_INDEX_STEP];
+    for(n %= UTF8_INDEX_STEP; n; n--)
+	pos += g_utf8_skip[(guchar)st->s[pos]];
+    return pos;
+}
+
+/* convert 1-based code point position at arg to 0-based; -1 if invalid */
+static lua_Integer utf8_index_arg(lua_State *L, utf8_index_state *st,
+				  int arg)
+{
+    lua_Integer n = luaL_checkinteger(L, arg);
+    if(n < 0)
+	n += st->len + 1;
+    if(n < 1 || n > st->len)
+	return -1;
+    return n - 1;
+}
+
+/***
+@type utf8_index
+*/
+
+/***
+Obtain the number of code points in the indexed string.
+@function utf8_index:len
+@treturn number The length of the string, in code points.
+*/
+static int utf8_index_len(lua_State *L)
+{
+    get_udata(L, 1, st, utf8_index_state);
+    lua_pushnumber(L, st->len);
+    return 1;
+}
+
+/***
+Obtain a substring of the indexed string.
+This works the same as `utf8_sub`, except that positions are counted as
+described for `utf8_index`:  embedded NUL characters are ordinary code
+points, rather than ending the count.
+@function utf8_index:sub
+@tparam[opt] number first The first Unicode code point (default is 1)
+@tparam[optchain] number last The last Unicode code point (default is -1)
+@treturn string The requested substring.  Out-of-bound ranges result in an
+ empty string.
+*/
+static int utf8_index_sub(lua_State *L)
+{
+    size_t first, last, sub;
+    get_udata(L, 1, st, utf8_index_state);
+    if(!utf8_sub_range(L, 2, st->len, &first, &last)) {
+	lua_pushliteral(L, "");
+	return 1;
+    }
+    sub = utf8_index_pos(st, first);
+    lua_pushlstring(L, st->s + sub, utf8_index_pos(st, last + 1) - sub);
+    return 1;
+}
+
+/***
+Find the byte position of a code point in the indexed string.
+@function utf8_index:offset
+@tparam number n The code point position; negative positions count
+ from the end of the string
+@treturn number|nil The byte position of the start of code point *n*
+ in the string, suitable for `string.sub`, or `nil` if *n* is out
+ of range.  For convenience, *n* may be one greater than the length
+ to return one byte past the end of the string.
+*/
+static int utf8_index_offset(lua_State *L)
+{
+    lua_Integer n;
+    get_udata(L, 1, st, utf8_index_state);
+    if(lua_isnumber(L, 2) && lua_tointeger(L, 2) == st->len + 1)
+	n = st->len;
+    else if((n = utf8_index_arg(L, st, 2)) < 0)
+	return 0;
+    lua_pushnumber(L, utf8_index_pos(st, n) + 1);
+    return 1;
+}
+
+/***
+Obtain a single code point from the indexed string.
+@function utf8_index:char_at
+@tparam number n The code point position; negative positions count
+ from the end of the string
+@treturn string|nil The character at position *n*, or `nil` if *n* is out
+ of range.
+*/
+static int utf8_index_char_at(lua_State *L)
+{
+    lua_Integer n;
+    size_t pos;
+    get_udata(L, 1, st, utf8_index_state);
+    if((n = utf8_index_arg(L, st, 2)) < 0)
+	return 0;
+    pos = utf8_index_pos(st, n);
+    lua_pushlstring(L, st->s + pos, utf8_index_pos(st, n + 1) - pos);
+    return 1;
+}
+
+static luaL_Reg utf8_index_state_funcs[] = {
+    {"len", utf8_index_len},
+    {"sub", utf8_index_sub},
+    {"offset", utf8_index_offset},
+    {"char_at", utf8_index_char_at},
+    {"__gc", free_utf8_index_state},
+    {NULL, NULL}
+};
+
+/*********************************************************************/
+/***
+Base64 Encoding
+@section Base64 Encoding
+*/
+
+/* input per step, such that the step's output fits in luaL_prepbuffer() */
+/* decoding leaves room for the vectorized decoder to overrun by 8 bytes */
+#define B64_ENCCHUNK ((LUAL_BUFFERSIZE / 4 - 2) * 3)
+#define B64_DECCHUNK ((LUAL_BUFFERSIZE - 8) / 3 * 4)
+
+typedef struct base64_state {
+    gint state, save; /* for g_base64_*_step() */
+    gboolean url, nopad; /* URL-safe alphabet; no padding */
+    int wrap, col; /* line length, if wrapping; current column */
+} base64_state;
+
+#ifdef LGLIB_X86_64
+/* Vectorized base64, after Muła and Lemire.  These only handle whole */
+/* groups of 3 input bytes or 4 valid (non-padding) base64 characters, */
+/* leaving the rest to GLib, so the results are identical. */
+
+/* 12 input bytes, in the low bytes of in, to 16 base64 characters */
+__attribute__((target("ssse3")))
+static inline __m128i b64_enc_ssse3(__m128i in)
+{
+    const __m128i shift_lut = _mm_setr_epi8(
+	'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+	'/' - 63, 'A', 0, 0);
+    __m128i t0, t1, idx, res;
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+					   4, 5, 3, 4, 1, 2, 0, 1));
+    t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+			 _mm_set1_epi32(0x04000040));
+    t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+			 _mm_set1_epi32(0x01000010));
+    idx = _mm_or_si128(t0, t1);
+    /* 0..25 -> 13, 26..51 -> 0, 52..63 -> 1..12 */
+    res = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    res = _mm_or_si128(res, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx),
+					  _mm_set1_epi8(13)));
+    return _mm_add_epi8(idx, _mm_shuffle_epi8(shift_lut, res));
+}
+
+/* returns number of bytes of in encoded; the output is 4/3 as long */
+__attribute__((target("ssse3")))
+static size_t b64_encode_ssse3(const guchar *in, size_t len, char *out)
+{
+    size_t i = 0;
+    for(; i + 16 <= len; i += 12, out += 16)
+	_mm_storeu_si128((__m128i *)out,
+			 b64_enc_ssse3(_mm_loadu_si128((const __m128i *)(in + i))));
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t b64_encode_avx2(const guchar *in, size_t len, char *out)
+{
+    const __m256i shift_lut = _mm256_setr_epi8(
+	'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+	'/' - 63, 'A', 0, 0,
+	'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+	'/' - 63, 'A', 0, 0);
+    const __m256i shuf = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+					 4, 5, 3, 4, 1, 2, 0, 1,
+					 10, 11, 9, 10, 7, 8, 6, 7,
+					 4, 5, 3, 4, 1, 2, 0, 1);
+    size_t i = 0;
+    for(; i + 28 <= len; i += 24, out += 32) {
+	__m256i v, t0, t1, idx, res;
+	v = _mm256_inserti128_si256(
+	    _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(in + i))),
+	    _mm_loadu_si128((const __m128i *)(in + i + 12)), 1);
+	v = _mm256_shuffle_epi8(v, shuf);
+	t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)),
+				_mm256_set1_epi32(0x04000040));
+	t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)),
+				_mm256_set1_epi32(0x01000010));
+	idx = _mm256_or_si256(t0, t1);
+	res = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+	res = _mm256_or_si256(res,
+			      _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx),
+					       _mm256_set1_epi8(13)));
+	_mm256_storeu_si256((__m256i *)out,
+			    _mm256_add_epi8(idx, _mm256_shuffle_epi8(shift_lut, res)));
+    }
+    return i + b64_encode_ssse3(in + i, len - i, out);
+}
+
+/* decode 16 characters to 12 bytes in the low part of *out; */
+/* returns FALSE if any character is not in the base64 alphabet */
+__attribute__((target("ssse3")))
+static inline gboolean b64_dec_ssse3(__m128i in, __m128i *out)
+{
+    const __m128i lut_lo = _mm_setr_epi8(
+	0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(
+	0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(
+	0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i hi = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+    __m128i lo = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+    __m128i bad = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo),
+				_mm_shuffle_epi8(lut_hi, hi));
+    __m128i v;
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(bad, _mm_setzero_si128())) != 0xffff)
+	return FALSE;
+    v = _mm_add_epi8(in, _mm_shuffle_epi8(lut_roll,
+					  _mm_add_epi8(_mm_cmpeq_epi8(in, _mm_set1_epi8('/')),
+						       hi)));
+    v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+    v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+    *out = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+					     14, 13, 12, -1, -1, -1, -1));
+    return TRUE;
+}
+
+/* returns number of characters of in decoded, stopping before the first */
+/* block with padding, whitespace or invalid characters; the output is */
+/* 3/4 as long, but up to 4 bytes beyond it may be overwritten */
+__attribute__((target("ssse3")))
+static size_t b64_decode_ssse3(const char *in, size_t len, guchar *out)
+{
+    size_t i = 0;
+    __m128i v;
+    for(; i + 16 <= len; i += 16, out += 12) {
+	if(!b64_dec_ssse3(_mm_loadu_si128((const __m128i *)(in + i)), &v))
+	    break;
+	_mm_storeu_si128((__m128i *)out, v);
+    }
+    return i;
+}
+
+/* as above, but up to 8 bytes beyond the output may be overwritten */
+__attribute__((target("avx2")))
+static size_t b64_decode_avx2(const char *in, size_t len, guchar *out)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(
+	0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+	0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(
+	0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+	0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(
+	2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+	2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32, out += 24) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi32(v, 4),
+				      _mm256_set1_epi8(0x0f));
+	__m256i lo = _mm256_and_si256(v, _mm256_set1_epi8(0x0f));
+	__m256i bad = _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo),
+				       _mm256_shuffle_epi8(lut_hi, hi));
+	if(!_mm256_testz_si256(bad, bad))
+	    break;
+	v = _mm256_add_epi8(v, _mm256_shuffle_epi8(lut_roll,
+						   _mm256_add_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')),
+								   hi)));
+	v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+	v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+	v = _mm256_shuffle_epi8(v, pack);
+	v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+	_mm256_storeu_si256((__m256i *)out, v);
+    }
+    return i + b64_decode_ssse3(in + i, len - i, out);
+}
+#endif
+
+/* g_base64_encode_step() without line breaks, vectorized if possible */
+static gsize base64_encode_step(const guchar *in, gsize len, char *out,
+				base64_state *st)
+{
+    gsize o = 0;
+#ifdef LGLIB_X86_64
+    if(cpu_has(CPU_SSSE3)) {
+	/* first complete any group left over from the last call */
+	/* GLib keeps the number of bytes held in the first byte of save */
+	int held = ((char *)&st->save)[0];
+	gsize n;
+	if(held) {
+	    n = MIN(len, 3 - held);
+	    o = g_base64_encode_step(in, n, 0, out, &st->state, &st->save);
+	    in += n;
+	    len -= n;
+	}
+	if(!((char *)&st->save)[0]) {
+	    n = cpu_has(CPU_AVX2) ? b64_encode_avx2(in, len, out + o) :
+				    b64_encode_ssse3(in, len, out + o);
+	    in += n;
+	    len -= n;
+	    o += n / 3 * 4;
+	}
+    }
+#endif
+    return o + g_base64_encode_step(in, len, 0, out + o, &st->state, &st->save);
+}
+
+/* g_base64_decode_step(), vectorized if possible; the output buffer must */
+/* have 8 bytes more than GLib requires */
+static gsize base64_decode_step(const char *in, gsize len, guchar *out,
+				base64_state *st)
+{
+#ifdef LGLIB_X86_64
+    if(cpu_has(CPU_SSSE3)) {
+	gsize o = 0, n;
+	while(len) {
+	    /* state is the number of characters in a partial group */
+	    while(len && st->state) {
+		o += g_base64_decode_step(in++, 1, out + o, &st->state,
+					  (guint *)&st->save);
+		len--;
+	    }
+	    n = cpu_has(CPU_AVX2) ? b64_decode_avx2(in, len, out + o) :
+				    b64_decode_ssse3(in, len, out + o);
+	    in += n;
+	    len -= n;
+	    o += n / 4 * 3;
+	    /* let GLib skip over whatever stopped the vector loop */
+	    n = MIN(len, 32);
+	    o += g_base64_decode_step(in, n, out + o, &st->state,
+				      (guint *)&st->save);
+	    in += n;
+	    len -= n;
+	}
+	return o;
+    }
+#endif
+    return g_base64_decode_step(in, len, out, &st->state, (guint *)&st->save);
+}
+
+
+/* add encoded output s (modifiable) to b, applying the URL-safe alphabet */
+/* and line wrapping if requested */
+static void base64_add(luaL_Buffer *b, char *s, size_t len, base64_state *st)
+{
+    if(st->url) {
+	size_t i;
+	for(i = 0; i < len; i++) {
+	    if(s[i] == '+')
+		s[i] = '-';
+	    else if(s[i] == '/')
+		s[i] = '_';
+	}
+    }
+    if(!st->wrap) {
+	luaL_addlstring(b, s, len);
+	return;
+    }
+    while(len) {
+	size_t n;
+	/* line breaks go before the next character, so there is never a */
+	/* trailing one */
+	if(st->col == st->wrap) {
+	    luaL_addlstring(b, "\r\n", 2);
+	    st->col = 0;
+	}
+	n = MIN(len, st->wrap - st->col);
+	luaL_addlstring(b, s, n);
+	st->col += n;
+	s += n;
+	len -= n;
+    }
+}
+
+/* encode s into b, continuing from st */
+static void base64_encode_buf(luaL_Buffer *b, const char *s, size_t sz,
+			      base64_state *st)
+{
+    char tmp[LUAL_BUFFERSIZE];
+    while(sz > 0) {
+	size_t encsz = sz > B64_ENCCHUNK ? B64_ENCCHUNK : sz;
+	if(!st->url && !st->wrap) {
+	    /* prepbuffer may move b->p, which 5.1's luaL_addsize uses, so */
+	    /* it must be called before luaL_addsize */
+	    size_t len = base64_encode_step((const guchar *)s, encsz,
+					    luaL_prepbuffer(b), st);
+	    luaL_addsize(b, len);
+	} else
+	    base64_add(b, tmp, base64_encode_step((const guchar *)s, encsz,
+						  tmp, st), st);
+	sz -= encsz;
+	s += encsz;
+    }
+}
+
+/* flush st's remaining input and padding into b, and reset st */
+static void base64_encode_close_buf(luaL_Buffer *b, base64_state *st)
+{
+    char tmp[8];
+    size_t len = g_base64_encode_close(0, tmp, &st->state, &st->save);
+    if(st->nopad)
+	while(len && tmp[len - 1] == '=')
+	    len--;
+    base64_add(b, tmp, len, st);
+    st->state = st->save = st->col = 0;
+}
+
+/* decode s into b, continuing from st */
+static void base64_decode_buf(luaL_Buffer *b, const char *s, size_t sz,
+			      base64_state *st)
+{
+    char tmp[B64_DECCHUNK];
+    while(sz > 0) {
+	size_t decsz = sz > B64_DECCHUNK ? B64_DECCHUNK : sz, len;
+	if(st->url) {
+	    size_t i;
+	    for(i = 0; i < decsz; i++)
+		tmp[i] = s[i] == '-' ? '+' : s[i] == '_' ? '/' : s[i];
+	}
+	len = base64_decode_step(st->url ? tmp : s, decsz,
+				 (guchar *)luaL_prepbuffer(b), st);
+	luaL_addsize(b, len);
+	sz -= decsz;
+	s += decsz;
+    }
+}
+
+/* finish decoding into b, and reset st; if padding is optional, this */
+/* flushes any partial group */
+static void base64_decode_close_buf(luaL_Buffer *b, base64_state *st)
+{
+    guint v = st->save;
+    /* GLib negates the count if the last character was padding */
+    int n = st->state < 0 ? -st->state : st->state;
+    if(st->nopad && n > 1) {
+	char tmp[2];
+	if(n == 2) {
+	    tmp[0] = v >> 4;
+	    n = 1;
+	} else {
+	    tmp[0] = v >> 10;
+	    tmp[1] = v >> 2;
+	    n = st->state < 0 ? 1 : 2;
+	}
+	luaL_addlstring(b, tmp, n);
+    }
+    st->state = st->save = 0;
+}
+
+/* parse base64 options table at arg into st */
+static void base64_options(lua_State *L, int arg, base64_state *st)
+{
+    lua_Number wrap;
+    if(lua_isnoneornil(L, arg))
+	return;
+    luaL_checktype(L, arg, LUA_TTABLE);
+    lua_getfield(L, arg, "url");
+    st->url = lua_toboolean(L, -1);
+    lua_getfield(L, arg, "pad");
+    st->nopad = !lua_isnil(L, -1) && !lua_toboolean(L, -1);
+    lua_getfield(L, arg, "wrap");
+    wrap = lua_tonumber(L, -1);
+    luaL_argcheck(L, wrap >= 0 && wrap <= G_MAXINT, arg, "invalid wrap width");
+    st->wrap = wrap;
+    lua_pop(L, 3);
+}
+
+/***
+Stream Base64-encoding function returned by `base64_encode`.
+This function is returned by `base64_encode` to support
+piecewise-encoding streams.  Simply call with string arguments,
+accumulating the returned strings.  When finished with the stream,
+call with no arguments.  This will return the final string to
+append and reset the stream for reuse.  Options given to
+`base64_encode` apply across the whole stream; in particular, line
+wrapping continues from where the previous piece left off.
+@function _base64_encode_
+@see base64_encode
+@tparam[opt] string s The next piece of the string to convert; absent
+ to finish conversion
+@treturn string The next piece of the converted string
+@usage
+enc = glib.base64_encode()
+while true do
+  buf = inf:read(4096)
+  if not buf then break end
+  outf:write(enc(buf))
+end
+outf:write(enc())
+*/
+static int stream_base64_encode(lua_State *L)
+{
+    size_t sz = 0;
+    const char *s = NULL;
+    luaL_Buffer b;
+
+    get_udata(L, lua_upvalueindex(1), st, base64_state);
+    if(!lua_isnoneornil(L, 1))
+	s = luaL_checklstring(L, 1, &sz);
+    luaL_buffinit(L, &b);
+    if(s)
+	base64_encode_buf(&b, s, sz, st);
+    else
+	base64_encode_close_buf(&b, st);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/***
+Base64-encode a string.
+This is a wrapper for `g_base64_encode()` and friends.
+@function base64_encode
+@see _base64_encode_
+@tparam[opt] string s The data to encode.  If absent or `nil`, return a
+ function like `_base64_encode_` for encoding a stream.
+@tparam[optchain] {string=value,...} options Encoding options:
+
+   * **url**: If set and not false, use the URL-safe alphabet
+     (`-` and `_` instead of `+` and `/`).
+   * **pad**: If set to false, omit the trailing `=` padding.
+   * **wrap**: If set and not zero, break lines with CRLF after this
+     many characters, as for MIME (which uses 76).
+@treturn string|function The base64-encoded stream (without newlines unless
+ *wrap* is set), or a function to do the same on a stream.
+@usage
+jwt_part = glib.base64_encode(s, {url = true, pad = false})
+mime_body = glib.base64_encode(s, {wrap = 76})
+*/
+static int glib_base64_encode(lua_State *L)
+{
+    size_t sz;
+    const char *s;
+    base64_state bs;
+    luaL_Buffer b;
+    if(lua_isnoneornil(L, 1)) {
+	alloc_udata(L, st, base64_state);
+	base64_options(L, 2, st);
+	lua_pushcclosure(L, stream_base64_encode, 1);
+	return 1;
+    }
+    s = luaL_checklstring(L, 1, &sz);
+    memset(&bs, 0, sizeof(bs));
+    base64_options(L, 2, &bs);
+    luaL_buffinit(L, &b);
+    base64_encode_buf(&b, s, sz, &bs);
+    base64_encode_close_buf(&b, &bs);
+    luaL_pushresult(&b);
+    return 1;
 }
 
 /***
@@ -1421,207 +4100,2087 @@ outf:write(dec())
 */
 static int stream_base64_decode(lua_State *L)
 {
-    size_t sz;
-    const char *s;
+    size_t sz = 0;
+    const char *s = NULL;
+    luaL_Buffer b;
 
     get_udata(L, lua_upvalueindex(1), st, base64_state);
-    if(lua_isnoneornil(L, 1)) {
-	memset(st, 0, sizeof(*st));
-	lua_pushliteral(L, "");
-	return 1;
-    }
-    s = luaL_checklstring(L, 1, &sz);
-    lua_pushliteral(L, "");
-    while(sz > 0) {
-	int decsz = sz > B64_DECCHUNK ? B64_DECCHUNK : sz, retsz;
-	retsz = g_base64_decode_step(s, decsz, (guchar *)st->obuf,
-				     &st->state, (guint *)&st->save);
-	if(retsz) {
-	    lua_pushlstring(L, st->obuf, retsz);
-	    lua_concat(L, 2);
-	}
-	sz -= decsz;
-	s += decsz;
-    }
+    if(!lua_isnoneornil(L, 1))
+	s = luaL_checklstring(L, 1, &sz);
+    luaL_buffinit(L, &b);
+    if(s)
+	base64_decode_buf(&b, s, sz, st);
+    else
+	base64_decode_close_buf(&b, st);
+    luaL_pushresult(&b);
     return 1;
 }
 
 /***
 Base64-decode a string.
-This is a wrapper for `g_base64_deocde()` and friends.
+This is a wrapper for `g_base64_deocde()` and friends.  Characters
+outside of the alphabet, such as line breaks, are ignored.
 @function base64_decode
 @see _base64_decode_
-@tparam[opt] string s The data to decode.  If absent, return a function
- like _base64_decode_ for decoding a stream.
+@tparam[opt] string s The data to decode.  If absent or `nil`, return a
+ function like _base64_decode_ for decoding a stream.
+@tparam[optchain] {string=value,...} options Decoding options:
+
+   * **url**: If set and not false, accept the URL-safe alphabet
+     (`-` and `_` instead of `+` and `/`).  The standard characters are
+     accepted as well.
+   * **pad**: If set to false, the input need not be padded; any trailing
+     partial group is decoded at the end.
 @treturn string|function The decoded form of the base64-encoded stream, or a
  function to do the same on a stream.
 */
 static int glib_base64_decode(lua_State *L)
 {
+    size_t sz;
     const char *s;
-    guchar *ret;
-    gsize rsz;
-    if(lua_gettop(L) == 0) {
+    base64_state bs;
+    luaL_Buffer b;
+    if(lua_isnoneornil(L, 1)) {
 	alloc_udata(L, st, base64_state);
+	base64_options(L, 2, st);
 	lua_pushcclosure(L, stream_base64_decode, 1);
 	return 1;
     }
-    s = luaL_checkstring(L, 1);
-    ret = g_base64_decode(s, &rsz);
-    lua_pushlstring(L, (char *)ret, rsz);
-    g_free(ret);
-    return 1;
+    s = luaL_checklstring(L, 1, &sz);
+    memset(&bs, 0, sizeof(bs));
+    base64_options(L, 2, &bs);
+    luaL_buffinit(L, &b);
+    base64_decode_buf(&b, s, sz, &bs);
+    base64_decode_close_buf(&b, &bs);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/*********************************************************************/
+/***
+Hex and Base32 Encoding
+@section Hex and Base32 Encoding
+*/
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static void hex_encode_scalar(const guchar *in, size_t len, char *out)
+{
+    size_t i;
+    for(i = 0; i < len; i++) {
+	*out++ = hex_digits[in[i] >> 4];
+	*out++ = hex_digits[in[i] & 0xf];
+    }
+}
+
+#ifdef LGLIB_X86_64
+/* nibbles to lower-case hex digits */
+static inline __m128i hex_digits_sse2(__m128i x)
+{
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(9)),
+				  _mm_set1_epi8('a' - '9' - 1));
+    return _mm_add_epi8(x, _mm_add_epi8(alpha, _mm_set1_epi8('0')));
+}
+
+static size_t hex_encode_sse2(const guchar *in, size_t len, char *out)
+{
+    size_t i;
+    for(i = 0; i + 16 <= len; i += 16, out += 32) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0xf));
+	__m128i lo = _mm_and_si128(v, _mm_set1_epi8(0xf));
+	_mm_storeu_si128((__m128i *)out,
+			 hex_digits_sse2(_mm_unpacklo_epi8(hi, lo)));
+	_mm_storeu_si128((__m128i *)(out + 16),
+			 hex_digits_sse2(_mm_unpackhi_epi8(hi, lo)));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i hex_digits_avx2(__m256i x)
+{
+    __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8(9)),
+				     _mm256_set1_epi8('a' - '9' - 1));
+    return _mm256_add_epi8(x, _mm256_add_epi8(alpha, _mm256_set1_epi8('0')));
+}
+
+__attribute__((target("avx2")))
+static size_t hex_encode_avx2(const guchar *in, size_t len, char *out)
+{
+    size_t i;
+    for(i = 0; i + 32 <= len; i += 32, out += 64) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4),
+				      _mm256_set1_epi8(0xf));
+	__m256i lo = _mm256_and_si256(v, _mm256_set1_epi8(0xf));
+	__m256i a = hex_digits_avx2(_mm256_unpacklo_epi8(hi, lo));
+	__m256i b = hex_digits_avx2(_mm256_unpackhi_epi8(hi, lo));
+	/* unpack works within 128-bit lanes */
+	_mm256_storeu_si256((__m256i *)out, _mm256_permute2x128_si256(a, b, 0x20));
+	_mm256_storeu_si256((__m256i *)(out + 32),
+			    _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    return i + hex_encode_sse2(in + i, len - i, out);
+}
+#endif
+
+/* write 2 * len lower-case hex digits for in to out */
+static void hex_encode(const guchar *in, size_t len, char *out)
+{
+    size_t n = 0;
+#ifdef LGLIB_X86_64
+    n = cpu_has(CPU_AVX2) ? hex_encode_avx2(in, len, out) :
+			    hex_encode_sse2(in, len, out);
+#endif
+    hex_encode_scalar(in + n, len - n, out + 2 * n);
+}
+
+/* state for codecs which carry a few bits between stream pieces */
+typedef struct bits_state {
+    guint64 bits; /* pending bits, in the low nbits */
+    int nbits;
+    int count; /* characters output, for padding */
+} bits_state;
+
+static void hex_encode_buf(luaL_Buffer *b, const char *s, size_t sz)
+{
+    while(sz > 0) {
+	size_t n = MIN(sz, LUAL_BUFFERSIZE / 2);
+	hex_encode((const guchar *)s, n, luaL_prepbuffer(b));
+	luaL_addsize(b, 2 * n);
+	s += n;
+	sz -= n;
+    }
+}
+
+/* value of hex digit c, or -1 */
+static int hex_value(guchar c)
+{
+    if(c >= '0' && c <= '9')
+	return c - '0';
+    c |= 0x20;
+    if(c >= 'a' && c <= 'f')
+	return c - 'a' + 10;
+    return -1;
+}
+
+static void hex_decode_buf(luaL_Buffer *b, const char *s, size_t sz,
+			   bits_state *st)
+{
+    while(sz > 0) {
+	size_t n = MIN(sz, LUAL_BUFFERSIZE * 2), i;
+	char *out = luaL_prepbuffer(b), *o = out;
+	for(i = 0; i < n; i++) {
+	    int v = hex_value(s[i]);
+	    if(v < 0)
+		continue;
+	    if(st->nbits) {
+		*o++ = (st->bits << 4) | v;
+		st->nbits = 0;
+	    } else {
+		st->bits = v;
+		st->nbits = 4;
+	    }
+	}
+	luaL_addsize(b, o - out);
+	s += n;
+	sz -= n;
+    }
+}
+
+/***
+Stream hex-encoding function returned by `hex_encode`.
+This works like `_base64_encode_`.  Since hex encoding needs no state,
+the final call always returns an empty string.
+@function _hex_encode_
+@see hex_encode
+@tparam[opt] string s The next piece of the string to convert; absent
+ to finish conversion
+@treturn string The next piece of the converted string
+*/
+static int stream_hex_encode(lua_State *L)
+{
+    size_t sz;
+    const char *s;
+    luaL_Buffer b;
+
+    if(lua_isnoneornil(L, 1)) {
+	lua_pushliteral(L, "");
+	return 1;
+    }
+    s = luaL_checklstring(L, 1, &sz);
+    luaL_buffinit(L, &b);
+    hex_encode_buf(&b, s, sz);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/***
+Hex-encode a string.
+Each byte is converted to two lower-case hexadecimal digits.
+@function hex_encode
+@see _hex_encode_
+@tparam[opt] string s The data to encode.  If absent or `nil`, return a
+ function like `_hex_encode_` for encoding a stream.
+@treturn string|function The hex-encoded data, or a function to do the
+ same on a stream.
+*/
+static int glib_hex_encode(lua_State *L)
+{
+    size_t sz;
+    const char *s;
+    luaL_Buffer b;
+    if(lua_isnoneornil(L, 1)) {
+	lua_pushcfunction(L, stream_hex_encode);
+	return 1;
+    }
+    s = luaL_checklstring(L, 1, &sz);
+    luaL_buffinit(L, &b);
+    hex_encode_buf(&b, s, sz);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/***
+Stream hex-decoding function returned by `hex_decode`.
+This works like `_base64_decode_`.  A digit left over at the end of a
+piece is combined with the first digit of the next.
+@function _hex_decode_
+@see hex_decode
+@tparam[opt] string s The next piece of the string to convert; absent
+ to finish conversion
+@treturn string The next piece of the converted output
+*/
+static int stream_hex_decode(lua_State *L)
+{
+    size_t sz;
+    const char *s;
+    luaL_Buffer b;
+
+    get_udata(L, lua_upvalueindex(1), st, bits_state);
+    if(lua_isnoneornil(L, 1)) {
+	memset(st, 0, sizeof(*st));
+	lua_pushliteral(L, "");
+	return 1;
+    }
+    s = luaL_checklstring(L, 1, &sz);
+    luaL_buffinit(L, &b);
+    hex_decode_buf(&b, s, sz, st);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/***
+Hex-decode a string.
+Upper- and lower-case digits are accepted.  As with `base64_decode`,
+any other characters (such as white space or separators) are ignored,
+as is a trailing odd digit.
+@function hex_decode
+@see _hex_decode_
+@tparam[opt] string s The data to decode.  If absent or `nil`, return a
+ function like `_hex_decode_` for decoding a stream.
+@treturn string|function The decoded data, or a function to do the
+ same on a stream.
+*/
+static int glib_hex_decode(lua_State *L)
+{
+    size_t sz;
+    const char *s;
+    bits_state bs = {0, 0, 0};
+    luaL_Buffer b;
+    if(lua_isnoneornil(L, 1)) {
+	alloc_udata(L, st, bits_state);
+	lua_pushcclosure(L, stream_hex_decode, 1);
+	return 1;
+    }
+    s = luaL_checklstring(L, 1, &sz);
+    luaL_buffinit(L, &b);
+    hex_decode_buf(&b, s, sz, &bs);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static const char base32_digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+
+static void base32_encode_buf(luaL_Buffer *b, const char *s, size_t sz,
+			      bits_state *st)
+{
+    while(sz > 0) {
+	/* each byte produces at most 2 characters */
+	size_t n = MIN(sz, LUAL_BUFFERSIZE / 2), i;
+	char *out = luaL_prepbuffer(b), *o = out;
+	for(i = 0; i < n; i++) {
+	    st->bits = (st->bits << 8) | (guchar)s[i];
+	    st->nbits += 8;
+	    while(st->nbits >= 5) {
+		st->nbits -= 5;
+		*o++ = base32_digits[(st->bits >> st->nbits) & 0x1f];
+	    }
+	}
+	st->count = (st->count + (o - out)) % 8;
+	luaL_addsize(b, o - out);
+	s += n;
+	sz -= n;
+    }
+}
+
+/* flush remaining bits and padding into b, and reset st */
+static void base32_encode_close_buf(luaL_Buffer *b, bits_state *st)
+{
+    if(st->nbits) {
+	luaL_addchar(b, base32_digits[(st->bits << (5 - st->nbits)) & 0x1f]);
+	st->count++;
+    }
+    if(st->count % 8)
+	luaL_addlstring(b, "=======", 8 - st->count % 8);
+    memset(st, 0, sizeof(*st));
+}
+
+static void base32_decode_buf(luaL_Buffer *b, const char *s, size_t sz,
+			      bits_state *st)
+{
+    while(sz > 0) {
+	size_t n = MIN(sz, LUAL_BUFFERSIZE), i;
+	char *out = luaL_prepbuffer(b), *o = out;
+	for(i = 0; i < n; i++) {
+	    guchar c = s[i];
+	    int v;
+	    if(c >= '2' && c <= '7')
+		v = c - '2' + 26;
+	    else if((c | 0x20) >= 'a' && (c | 0x20) <= 'z')
+		v = (c | 0x20) - 'a';
+	    else
+		continue;
+	    st->bits = (st->bits << 5) | v;
+	    st->nbits += 5;
+	    if(st->nbits >= 8) {
+		st->nbits -= 8;
+		*o++ = st->bits >> st->nbits;
+	    }
+	}
+	luaL_addsize(b, o - out);
+	s += n;
+	sz -= n;
+    }
+}
+
+/***
+Stream Base32-encoding function returned by `base32_encode`.
+This works like `_base64_encode_`.
+@function _base32_encode_
+@see base32_encode
+@tparam[opt] string s The next piece of the string to convert; absent
+ to finish conversion
+@treturn string The next piece of the converted string
+*/
+static int stream_base32_encode(lua_State *L)
+{
+    size_t sz = 0;
+    const char *s = NULL;
+    luaL_Buffer b;
+
+    get_udata(L, lua_upvalueindex(1), st, bits_state);
+    if(!lua_isnoneornil(L, 1))
+	s = luaL_checklstring(L, 1, &sz);
+    luaL_buffinit(L, &b);
+    if(s)
+	base32_encode_buf(&b, s, sz, st);
+    else
+	base32_encode_close_buf(&b, st);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/***
+Base32-encode a string.
+This uses the RFC 4648 alphabet (`A`-`Z`, `2`-`7`), with `=` padding.
+@function base32_encode
+@see _base32_encode_
+@tparam[opt] string s The data to encode.  If absent or `nil`, return a
+ function like `_base32_encode_` for encoding a stream.
+@treturn string|function The base32-encoded data, or a function to do the
+ same on a stream.
+*/
+static int glib_base32_encode(lua_State *L)
+{
+    size_t sz;
+    const char *s;
+    bits_state bs = {0, 0, 0};
+    luaL_Buffer b;
+    if(lua_isnoneornil(L, 1)) {
+	alloc_udata(L, st, bits_state);
+	lua_pushcclosure(L, stream_base32_encode, 1);
+	return 1;
+    }
+    s = luaL_checklstring(L, 1, &sz);
+    luaL_buffinit(L, &b);
+    base32_encode_buf(&b, s, sz, &bs);
+    base32_encode_close_buf(&b, &bs);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/***
+Stream Base32-decoding function returned by `base32_decode`.
+This works like `_base64_decode_`.
+@function _base32_decode_
+@see base32_decode
+@tparam[opt] string s The next piece of the string to convert; absent
+ to finish conversion
+@treturn string The next piece of the converted output
+*/
+static int stream_base32_decode(lua_State *L)
+{
+    size_t sz;
+    const char *s;
+    luaL_Buffer b;
+
+    get_udata(L, lua_upvalueindex(1), st, bits_state);
+    if(lua_isnoneornil(L, 1)) {
+	memset(st, 0, sizeof(*st));
+	lua_pushliteral(L, "");
+	return 1;
+    }
+    s = luaL_checklstring(L, 1, &sz);
+    luaL_buffinit(L, &b);
+    base32_decode_buf(&b, s, sz, st);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/***
+Base32-decode a string.
+Upper- and lower-case letters are accepted.  As with `base64_decode`,
+padding and any other characters outside of the alphabet are ignored.
+@function base32_decode
+@see _base32_decode_
+@tparam[opt] string s The data to decode.  If absent or `nil`, return a
+ function like `_base32_decode_` for decoding a stream.
+@treturn string|function The decoded data, or a function to do the
+ same on a stream.
+*/
+static int glib_base32_decode(lua_State *L)
+{
+    size_t sz;
+    const char *s;
+    bits_state bs = {0, 0, 0};
+    luaL_Buffer b;
+    if(lua_isnoneornil(L, 1)) {
+	alloc_udata(L, st, bits_state);
+	lua_pushcclosure(L, stream_base32_decode, 1);
+	return 1;
+    }
+    s = luaL_checklstring(L, 1, &sz);
+    luaL_buffinit(L, &b);
+    base32_decode_buf(&b, s, sz, &bs);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/*********************************************************************/
+/***
+Data Checksums
+@section Data Checksums
+*/
+
+/* Checksums go through a thin wrapper around GChecksum, so that SHA-1 and */
+/* SHA-256 can use the x86 SHA extensions when present.  The accelerated */
+/* code is checked against GChecksum when the library is loaded, and only */
+/* used if it produces identical results. */
+typedef struct checksum {
+    GChecksum *gsum; /* if non-NULL, none of the rest is used */
+    GChecksumType type;
+    guint32 h[8];
+    guint64 len;
+    guchar buf[64];
+} checksum;
+
+#ifdef LGLIB_X86_64
+static gboolean sha_ni_ok = FALSE;
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(guint32 *h, const guchar *data, size_t nblk)
+{
+    static const guint32 k[64] __attribute__((aligned(16))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL,
+					 0x0405060700010203LL);
+    __m128i s0, s1, t, w0, w1, w2, w3, abef, cdgh;
+
+    /* the round instructions want the state as ABEF and CDGH */
+    t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0xb1);
+    s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(h + 4)), 0x1b);
+    s0 = _mm_alignr_epi8(t, s1, 8);
+    s1 = _mm_blend_epi16(s1, t, 0xf0);
+    for(; nblk; nblk--, data += 64) {
+	abef = s0;
+	cdgh = s1;
+	w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap);
+	w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), bswap);
+	w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), bswap);
+	w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), bswap);
+	/* 4 rounds using w; then replace w with the schedule 4 groups on */
+#define SHA256_4(i, w, x, y, z) do { \
+    t = _mm_add_epi32(w, _mm_load_si128((const __m128i *)(k + 4 * (i)))); \
+    s1 = _mm_sha256rnds2_epu32(s1, s0, t); \
+    s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(t, 0x0e)); \
+    if((i) < 12) \
+	w = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w, x), \
+					       _mm_alignr_epi8(z, y, 4)), z); \
+} while(0)
+	SHA256_4(0, w0, w1, w2, w3);
+	SHA256_4(1, w1, w2, w3, w0);
+	SHA256_4(2, w2, w3, w0, w1);
+	SHA256_4(3, w3, w0, w1, w2);
+	SHA256_4(4, w0, w1, w2, w3);
+	SHA256_4(5, w1, w2, w3, w0);
+	SHA256_4(6, w2, w3, w0, w1);
+	SHA256_4(7, w3, w0, w1, w2);
+	SHA256_4(8, w0, w1, w2, w3);
+	SHA256_4(9, w1, w2, w3, w0);
+	SHA256_4(10, w2, w3, w0, w1);
+	SHA256_4(11, w3, w0, w1, w2);
+	SHA256_4(12, w0, w1, w2, w3);
+	SHA256_4(13, w1, w2, w3, w0);
+	SHA256_4(14, w2, w3, w0, w1);
+	SHA256_4(15, w3, w0, w1, w2);
+#undef SHA256_4
+	s0 = _mm_add_epi32(s0, abef);
+	s1 = _mm_add_epi32(s1, cdgh);
+    }
+    t = _mm_shuffle_epi32(s0, 0x1b);
+    s1 = _mm_shuffle_epi32(s1, 0xb1);
+    _mm_storeu_si128((__m128i *)h, _mm_blend_epi16(t, s1, 0xf0));
+    _mm_storeu_si128((__m128i *)(h + 4), _mm_alignr_epi8(s1, t, 8));
+}
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_shani(guint32 *h, const guchar *data, size_t nblk)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0001020304050607LL,
+					 0x08090a0b0c0d0e0fLL);
+    __m128i abcd, e0, e, prev, w0, w1, w2, w3, abcd_save;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0x1b);
+    e0 = _mm_set_epi32(h[4], 0, 0, 0);
+    for(; nblk; nblk--, data += 64) {
+	abcd_save = abcd;
+	w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap);
+	w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), bswap);
+	w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), bswap);
+	w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), bswap);
+	/* 4 rounds using w, which is first replaced with the schedule */
+	/* 4 groups on if sched is set */
+#define SHA1_4(f, sched, w, x, y, z) do { \
+    if(sched) \
+	w = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(w, x), y), z); \
+    e = _mm_sha1nexte_epu32(prev, w); \
+    prev = abcd; \
+    abcd = _mm_sha1rnds4_epu32(abcd, e, f); \
+} while(0)
+	prev = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, _mm_add_epi32(e0, w0), 0);
+	SHA1_4(0, 0, w1, w2, w3, w0);
+	SHA1_4(0, 0, w2, w3, w0, w1);
+	SHA1_4(0, 0, w3, w0, w1, w2);
+	SHA1_4(0, 1, w0, w1, w2, w3);
+	SHA1_4(1, 1, w1, w2, w3, w0);
+	SHA1_4(1, 1, w2, w3, w0, w1);
+	SHA1_4(1, 1, w3, w0, w1, w2);
+	SHA1_4(1, 1, w0, w1, w2, w3);
+	SHA1_4(1, 1, w1, w2, w3, w0);
+	SHA1_4(2, 1, w2, w3, w0, w1);
+	SHA1_4(2, 1, w3, w0, w1, w2);
+	SHA1_4(2, 1, w0, w1, w2, w3);
+	SHA1_4(2, 1, w1, w2, w3, w0);
+	SHA1_4(2, 1, w2, w3, w0, w1);
+	SHA1_4(3, 1, w3, w0, w1, w2);
+	SHA1_4(3, 1, w0, w1, w2, w3);
+	SHA1_4(3, 1, w1, w2, w3, w0);
+	SHA1_4(3, 1, w2, w3, w0, w1);
+	SHA1_4(3, 1, w3, w0, w1, w2);
+#undef SHA1_4
+	e0 = _mm_sha1nexte_epu32(prev, e0);
+	abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+    _mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(abcd, 0x1b));
+    h[4] = _mm_extract_epi32(e0, 3);
+}
+
+static void checksum_blocks(checksum *sum, const guchar *data, size_t nblk)
+{
+    if(sum->type == G_CHECKSUM_SHA256)
+	sha256_blocks_shani(sum->h, data, nblk);
+    else
+	sha1_blocks_shani(sum->h, data, nblk);
+}
+
+static void checksum_init(checksum *sum, GChecksumType ct)
+{
+    static const guint32 sha1_iv[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+    };
+    static const guint32 sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    sum->gsum = NULL;
+    sum->type = ct;
+    sum->len = 0;
+    if(ct == G_CHECKSUM_SHA256)
+	memcpy(sum->h, sha256_iv, sizeof(sha256_iv));
+    else
+	memcpy(sum->h, sha1_iv, sizeof(sha1_iv));
+}
+#endif
+
+static checksum *checksum_new(GChecksumType ct)
+{
+    checksum *sum = g_new(checksum, 1);
+#ifdef LGLIB_X86_64
+    if(sha_ni_ok && (ct == G_CHECKSUM_SHA1 || ct == G_CHECKSUM_SHA256)) {
+	checksum_init(sum, ct);
+	return sum;
+    }
+#endif
+    sum->gsum = g_checksum_new(ct);
+    sum->type = ct;
+    return sum;
+}
+
+static void checksum_free(checksum *sum)
+{
+    if(sum->gsum)
+	g_checksum_free(sum->gsum);
+    g_free(sum);
+}
+
+static void checksum_reset(checksum *sum)
+{
+#ifdef LGLIB_X86_64
+    if(!sum->gsum) {
+	checksum_init(sum, sum->type);
+	return;
+    }
+#endif
+    g_checksum_reset(sum->gsum);
+}
+
+static void checksum_update(checksum *sum, const guchar *data, gsize len)
+{
+#ifdef LGLIB_X86_64
+    gsize off;
+    if(!sum->gsum) {
+	off = sum->len % 64;
+	sum->len += len;
+	if(off) {
+	    gsize n = MIN(len, 64 - off);
+	    memcpy(sum->buf + off, data, n);
+	    if(off + n < 64)
+		return;
+	    checksum_blocks(sum, sum->buf, 1);
+	    data += n;
+	    len -= n;
+	}
+	if(len >= 64)
+	    checksum_blocks(sum, data, len / 64);
+	memcpy(sum->buf, data + len / 64 * 64, len % 64);
+	return;
+    }
+#endif
+    g_checksum_update(sum->gsum, data, len);
+}
+
+/* like g_checksum_get_digest(), sum may not be updated afterwards */
+static void checksum_get_digest(checksum *sum, guint8 *digest, gsize *len)
+{
+#ifdef LGLIB_X86_64
+    if(!sum->gsum) {
+	int i, nw = sum->type == G_CHECKSUM_SHA256 ? 8 : 5;
+	gsize off = sum->len % 64;
+	guint64 bits = sum->len * 8;
+	/* pad with 0x80, zeros, and the big-endian bit length */
+	sum->buf[off++] = 0x80;
+	if(off > 56) {
+	    memset(sum->buf + off, 0, 64 - off);
+	    checksum_blocks(sum, sum->buf, 1);
+	    off = 0;
+	}
+	memset(sum->buf + off, 0, 56 - off);
+	for(i = 0; i < 8; i++)
+	    sum->buf[63 - i] = bits >> (8 * i);
+	checksum_blocks(sum, sum->buf, 1);
+	for(i = 0; i < nw; i++) {
+	    digest[4 * i] = sum->h[i] >> 24;
+	    digest[4 * i + 1] = sum->h[i] >> 16;
+	    digest[4 * i + 2] = sum->h[i] >> 8;
+	    digest[4 * i + 3] = sum->h[i];
+	}
+	*len = 4 * nw;
+	return;
+    }
+#endif
+    g_checksum_get_digest(sum->gsum, digest, len);
+}
+
+#ifdef LGLIB_X86_64
+/* check the accelerated checksums against GChecksum's results */
+static gboolean checksum_selftest(void)
+{
+    static const GChecksumType types[] = {
+	G_CHECKSUM_SHA1, G_CHECKSUM_SHA256
+    };
+    static const gsize lens[] = { 0, 1, 55, 56, 63, 64, 65, 119, 128, 1000 };
+    guchar data[1000];
+    guint8 d1[32], d2[32];
+    gsize i, j, l1, l2;
+    checksum sum;
+    if(!cpu_has(CPU_SHA))
+	return FALSE;
+    for(i = 0; i < sizeof(data); i++)
+	data[i] = i * 131 + (i >> 3);
+    for(i = 0; i < G_N_ELEMENTS(types); i++)
+	for(j = 0; j < G_N_ELEMENTS(lens); j++) {
+	    GChecksum *gsum = g_checksum_new(types[i]);
+	    checksum_init(&sum, types[i]);
+	    /* feed in two pieces to exercise the partial block buffer */
+	    checksum_update(&sum, data, lens[j] / 3);
+	    checksum_update(&sum, data + lens[j] / 3, lens[j] - lens[j] / 3);
+	    g_checksum_update(gsum, data, lens[j]);
+	    l1 = l2 = sizeof(d1);
+	    checksum_get_digest(&sum, d1, &l1);
+	    g_checksum_get_digest(gsum, d2, &l2);
+	    g_checksum_free(gsum);
+	    if(l1 != l2 || memcmp(d1, d2, l1))
+		return FALSE;
+	}
+    return TRUE;
+}
+#endif
+
+typedef struct sumstate {
+    checksum *sum;
+} sumstate;
+
+static int free_sumstate(lua_State *L)
+{
+    get_udata(L, 1, st, sumstate);
+    if(st->sum)
+	checksum_free(st->sum);
+    return 0;
+}
+
+static int push_digest(lua_State *L, const guint8 *digest, gsize len,
+		       gboolean raw)
+{
+    if(raw)
+	lua_pushlstring(L, (const char *)digest, len);
+    else {
+	char hex[128];
+	hex_encode(digest, len, hex);
+	lua_pushlstring(L, hex, 2 * len);
+    }
+    return 1;
+}
+
+/* return type is lifted from cmorris' lua-glib */
+static int finalize_sum(lua_State *L, checksum *sum, gboolean raw)
+{
+    guint8 digest[64];
+    gsize digest_len = 64;
+    checksum_get_digest(sum, digest, &digest_len);
+    push_digest(L, digest, digest_len, raw);
+    checksum_free(sum);
+    return 1;
+}
+
+/***
+Stream checksum/hash calculation function type.
+This function is returned by `md5sum`, `sha1sum`, or `sha256sum` to support
+computing stream checksums piecewise.  Simply call with string arguments,
+until the stream is complete.  Then, call with an absent or `nil`
+argument to return the final checksum.  Doing so invalidates
+the state, so that the function returns an error from that point
+forward.
+@function _sum_
+@see md5sum
+@see sha1sum
+@see sha256sum
+@tparam[opt] string s The next piece of the string to checksum; absent
+ or `nil` to finish checksum
+@tparam[opt] boolean raw True if checksum should be returned in binary
+ form.  Otherwise, return the lower-case hexadecimal-encoded form (ignored
+ if *s* is not `nil`)
+@treturn |nil|string Nothing unless *s* is absent or `nil`.  Otherwise, return
+ the computed checksum.
+@raise If the state is invalid, always return `nil`.
+@usage
+sumf = glib.md5sum()
+while true do
+  buf = inf:read(4096)
+  if not buf then break end
+  sumf(buf)
+end
+sum = sumf()
+*/
+static int stream_sum(lua_State *L)
+{
+    checksum *sum;
+    get_udata(L, lua_upvalueindex(1), st, sumstate);
+    if(!st->sum) {
+	lua_pushnil(L);
+	return 1;
+    }
+    if(lua_gettop(L) > 0 && lua_isstring(L, 1)) {
+	size_t sz;
+	const char *s = luaL_checklstring(L, 1, &sz);
+	checksum_update(st->sum, (const guchar *)s, sz);
+	return 0;
+    }
+    sum = st->sum;
+    st->sum = NULL;
+    return finalize_sum(L, sum, lua_toboolean(L, 1));
+}
+
+static int glib_sum(lua_State *L, GChecksumType ct)
+{
+    size_t sz;
+    const char *s;
+    checksum *sum;
+
+    if(lua_gettop(L) == 0) {
+	alloc_udata(L, st, sumstate);
+	st->sum = checksum_new(ct);
+	lua_pushcclosure(L, stream_sum, 1);
+	return 1;
+    }
+    sum = checksum_new(ct);
+    s = luaL_checklstring(L, 1, &sz);
+    checksum_update(sum, (const guchar *)s, sz);
+    return finalize_sum(L, sum, lua_toboolean(L, 2));
+}
+
+/***
+Compute MD5 checksum of a string.
+This is a wrapper for `g_checksum_new()` and friends.
+@function md5sum
+@see _sum_
+@tparam[opt] string s The data to checksum.  If absent, return a
+ function like `_sum_` to checksum a stream piecewise.
+@tparam[optchain] boolean raw True if checksum should be returned in binary
+ form.  Otherwise, return the lower-case hexadecimal-encoded form (ignored
+ if *s* is `nil`)
+@treturn string|function The MD5 checksum or a stream converter function.
+*/
+static int glib_md5sum(lua_State *L)
+{
+    return glib_sum(L, G_CHECKSUM_MD5);
+}
+
+/***
+Compute SHA1 checksum of a string.
+This is a wrapper for `g_checksum_new()` and friends.
+@function sha1sum
+@see _sum_
+@tparam[opt] string s The data to checksum.  If absent, return a
+ function like `_sum_` to checksum a stream piecewise.
+@tparam[optchain] boolean raw True if checksum should be returned in binary
+ form.  Otherwise, return the lower-case hexadecimal-encoded form (ignored
+ if *s* is `nil`)
+@treturn string|function The SHA1 checksum or a stream converter function.
+*/
+static int glib_sha1sum(lua_State *L)
+{
+    return glib_sum(L, G_CHECKSUM_SHA1);
+}
+
+/***
+Compute SHA256 checksum of a string.
+This is a wrapper for `g_checksum_new()` and friends.
+@function sha256sum
+@see _sum_
+@tparam[opt] string s The data to checksum.  If absent, return a
+ function like `_sum_` to checksum a stream piecewise.
+@tparam[optchain] boolean raw True if checksum should be returned in binary
+ form.  Otherwise, return the lower-case hexadecimal-encoded form (ignored
+ if *s* is `nil`)
+@treturn string|function The SHA256 checksum or a stream converter function.
+*/
+static int glib_sha256sum(lua_State *L)
+{
+    return glib_sum(L, G_CHECKSUM_SHA256);
+}
+
+/* checksum names accepted by functions taking a checksum type */
+static const char *const checksum_names[] = {
+    "md5", "sha1", "sha256",
+#if GLIB_CHECK_VERSION(2, 36, 0)
+    "sha512",
+#endif
+#if GLIB_CHECK_VERSION(2, 52, 0)
+    "sha384",
+#endif
+    NULL
+};
+
+static const GChecksumType checksum_types[] = {
+    G_CHECKSUM_MD5, G_CHECKSUM_SHA1, G_CHECKSUM_SHA256,
+#if GLIB_CHECK_VERSION(2, 36, 0)
+    G_CHECKSUM_SHA512,
+#endif
+#if GLIB_CHECK_VERSION(2, 52, 0)
+    G_CHECKSUM_SHA384,
+#endif
+};
+
+/* checksum type named by value at idx; raises an error for argument arg */
+/* if it is not a valid name */
+static GChecksumType check_checksum_type(lua_State *L, int idx, int arg)
+{
+    const char *name = lua_tostring(L, idx);
+    int i;
+    for(i = 0; name && checksum_names[i]; i++)
+	if(!strcmp(name, checksum_names[i]))
+	    return checksum_types[i];
+    return luaL_argerror(L, arg, "invalid checksum type");
+}
+
+#define MULTISUM_MAX 8
+/* chunks at least this large are hashed on multiple threads */
+#define MULTISUM_THREAD_MIN (256 * 1024)
+
+typedef struct multisum_state {
+    checksum *sum[MULTISUM_MAX];
+    int nsum;
+    /* the chunk being hashed by worker threads */
+    const guchar *buf;
+    gsize len;
+} multisum_state;
+
+static int free_multisum_state(lua_State *L)
+{
+    int i;
+    get_udata(L, 1, st, multisum_state);
+    for(i = 0; i < st->nsum; i++)
+	if(st->sum[i]) {
+	    checksum_free(st->sum[i]);
+	    st->sum[i] = NULL;
+	}
+    return 0;
+}
+
+typedef struct multisum_job {
+    multisum_state *st;
+    int i;
+} multisum_job;
+
+static gpointer multisum_thread(gpointer data)
+{
+    multisum_job *job = data;
+    checksum_update(job->st->sum[job->i], job->st->buf, job->st->len);
+    return NULL;
+}
+
+/***
+Stream multiple checksum calculation function.
+This function is returned by `multisum` to compute several checksums
+of a stream at once.  Simply call with string arguments, until the
+stream is complete.  Then, call with an absent or `nil` argument to
+return the final checksums.  Doing so invalidates the state, so that
+the function returns an error from that point forward.  Large pieces
+of the stream are checksummed in parallel, one thread per checksum.
+@function _multisum_
+@see multisum
+@tparam[opt] string s The next piece of the string to checksum; absent
+ or `nil` to finish checksum
+@tparam[opt] boolean raw True if checksums should be returned in binary
+ form.  Otherwise, return the lower-case hexadecimal-encoded form (ignored
+ if *s* is not `nil`)
+@treturn |nil|string,... Nothing unless *s* is absent or `nil`.  Otherwise,
+ return the computed checksums, in the order they were requested.
+@raise If the state is invalid, always return `nil`.
+@usage
+sumf = glib.multisum{'md5', 'sha1', 'sha256'}
+while true do
+  buf = inf:read(1024 * 1024)
+  if not buf then break end
+  sumf(buf)
+end
+md5, sha1, sha256 = sumf()
+*/
+static int stream_multisum(lua_State *L)
+{
+    int i;
+    gboolean raw;
+    get_udata(L, lua_upvalueindex(1), st, multisum_state);
+    if(!st->sum[0]) {
+	lua_pushnil(L);
+	return 1;
+    }
+    if(lua_gettop(L) > 0 && lua_isstring(L, 1)) {
+	size_t sz;
+	const char *s = luaL_checklstring(L, 1, &sz);
+	if(sz >= MULTISUM_THREAD_MIN && st->nsum > 1) {
+	    multisum_job job[MULTISUM_MAX];
+	    GThread *th[MULTISUM_MAX];
+	    st->buf = (const guchar *)s;
+	    st->len = sz;
+	    /* the first checksum is done by this thread */
+	    for(i = 1; i < st->nsum; i++) {
+		job[i].st = st;
+		job[i].i = i;
+		th[i] = g_thread_new("sum", multisum_thread, &job[i]);
+	    }
+	    checksum_update(st->sum[0], st->buf, sz);
+	    for(i = 1; i < st->nsum; i++)
+		g_thread_join(th[i]);
+	} else
+	    for(i = 0; i < st->nsum; i++)
+		checksum_update(st->sum[i], (const guchar *)s, sz);
+	return 0;
+    }
+    raw = lua_toboolean(L, 1);
+    for(i = 0; i < st->nsum; i++) {
+	checksum *sum = st->sum[i];
+	st->sum[i] = NULL;
+	finalize_sum(L, sum, raw);
+    }
+    return st->nsum;
+}
+
+/***
+Compute several checksums of a stream at once.
+This returns a function like `_sum_`, except that it updates all of the
+requested checksums with each call, and returns all of them at the end.
+@function multisum
+@see _multisum_
+@tparam {string,...} types The checksums to compute; each is one of `md5`,
+ `sha1`, `sha256`, `sha512` (GLib 2.36 or later) or `sha384` (GLib 2.52
+ or later).  At most 8 may be given.
+@treturn function A function like `_multisum_`.
+*/
+static int glib_multisum(lua_State *L)
+{
+    int i, n;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    n = lua_rawlen(L, 1);
+    luaL_argcheck(L, n > 0 && n <= MULTISUM_MAX, 1,
+		  "1 to 8 checksum types expected");
+    {
+	alloc_udata(L, st, multisum_state);
+	for(i = 0; i < n; i++) {
+	    lua_rawgeti(L, 1, i + 1);
+	    st->sum[i] = checksum_new(check_checksum_type(L, -1, 1));
+	    st->nsum = i + 1;
+	    lua_pop(L, 1);
+	}
+	lua_pushcclosure(L, stream_multisum, 1);
+    }
+    return 1;
+}
+
+/***
+Compute the checksums of an array of strings.
+This is equivalent to calling `md5sum` or similar on every element of
+*tbl*, but only a single checksum state is used for all elements.
+@function sum_batch
+@see md5sum
+@tparam string type The checksum type, as for `file_sum`
+@tparam {string,...} tbl The strings to checksum
+@tparam[opt] boolean raw True if the digests should be returned in binary
+ form, concatenated into a single string.  Otherwise, return an array of
+ lower-case hexadecimal-encoded digests.
+@treturn {string,...}|string The digests
+@usage
+-- binary digest of element i
+sums = glib.sum_batch('sha1', records, true)
+d = sums:sub(20 * (i - 1) + 1, 20 * i)
+*/
+static int glib_sum_batch(lua_State *L)
+{
+    GChecksumType ct = check_checksum_type(L, 1, 1);
+    gboolean raw = lua_toboolean(L, 3);
+    guint8 digest[64];
+    gsize len;
+    size_t n, i, sz;
+    const char *s;
+    luaL_Buffer b;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = lua_rawlen(L, 2);
+    lua_settop(L, 2);
+    {
+	/* the state is kept in a userdata so it is freed on errors */
+	alloc_udata(L, st, sumstate);
+	st->sum = checksum_new(ct);
+	if(raw)
+	    luaL_buffinit(L, &b);
+	else
+	    lua_createtable(L, n, 0);
+	for(i = 1; i <= n; i++) {
+	    lua_rawgeti(L, 2, i);
+	    if(!lua_isstring(L, -1))
+		return luaL_argerror(L, 2,
+				     lua_pushfstring(L, "string expected at index %d",
+						     (int)i));
+	    s = lua_tolstring(L, -1, &sz);
+	    if(i > 1)
+		checksum_reset(st->sum);
+	    checksum_update(st->sum, (const guchar *)s, sz);
+	    lua_pop(L, 1);
+	    len = sizeof(digest);
+	    checksum_get_digest(st->sum, digest, &len);
+	    if(raw)
+		luaL_addlstring(&b, (const char *)digest, len);
+	    else {
+		push_digest(L, digest, len, FALSE);
+		lua_rawseti(L, -2, i);
+	    }
+	}
+	if(raw)
+	    luaL_pushresult(&b);
+    }
+    return 1;
+}
+
+/* read buffer for hashing files; large reads keep syscall overhead low */
+#define FILE_SUM_BUFSIZE (1024 * 1024)
+
+typedef void (*data_cb)(gpointer data, const guchar *buf, gsize len);
+
+/* pass the remaining contents of fd (or f, if not NULL) to cb; */
+/* returns 0 or errno */
+static int feed_file(int fd, FILE *f, data_cb cb, gpointer data)
+{
+    guchar *buf = g_malloc(FILE_SUM_BUFSIZE);
+    int ret = 0;
+#if defined(G_OS_UNIX) && defined(POSIX_FADV_SEQUENTIAL)
+    if(!f)
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    while(1) {
+	gssize n;
+	if(f) {
+	    n = fread(buf, 1, FILE_SUM_BUFSIZE, f);
+	    if(!n && ferror(f))
+		n = -1;
+	} else
+	    n = read(fd, buf, FILE_SUM_BUFSIZE);
+	if(n < 0) {
+	    if(errno == EINTR)
+		continue;
+	    ret = errno;
+	    break;
+	}
+	if(!n)
+	    break;
+	cb(data, buf, n);
+    }
+    g_free(buf);
+    return ret;
+}
+
+/* get file at arg as a path, Lua file or file descriptor; returns 1 if */
+/* it was opened here and needs to be closed, 0 if not, or -1 after */
+/* pushing nil, an error message and errno if it can't be opened */
+static int file_arg(lua_State *L, int arg, int *fd, FILE **f)
+{
+    *f = NULL;
+    if(lua_type(L, arg) == LUA_TSTRING) {
+	const char *path = lua_tostring(L, arg);
+	*fd = g_open(path, O_RDONLY | O_BINARY, 0);
+	if(*fd < 0) {
+	    int en = errno;
+	    lua_pushnil(L);
+	    lua_pushfstring(L, "%s: %s", path, strerror(en));
+	    lua_pushinteger(L, en);
+	    return -1;
+	}
+	return 1;
+    }
+    *fd = 0;
+    if(lua_type(L, arg) == LUA_TNUMBER)
+	*fd = lua_tointeger(L, arg);
+    else
+	*f = check_file(L, arg);
+    return 0;
+}
+
+static void checksum_cb(gpointer data, const guchar *buf, gsize len)
+{
+    checksum_update(data, buf, len);
+}
+
+/***
+Compute the checksum of a file.
+The file is read in large blocks directly into the checksum, rather
+than passing its contents through Lua strings.
+@function file_sum
+@see md5sum
+@tparam string|file|number file The file to checksum:  a path name, an
+ open Lua file (read from its current position), or a file descriptor
+ (likewise)
+@tparam string type The checksum type; one of `md5`, `sha1`, `sha256`,
+ `sha512` (GLib 2.36 or later) or `sha384` (GLib 2.52 or later)
+@tparam[opt] boolean raw True if checksum should be returned in binary
+ form.  Otherwise, return the lower-case hexadecimal-encoded form
+@treturn string The checksum
+@raise Returns `nil`, an error message and the error number if the file
+ could not be opened or read.
+*/
+static int glib_file_sum(lua_State *L)
+{
+    GChecksumType ct = check_checksum_type(L, 2, 2);
+    checksum *sum;
+    int opened, fd, en;
+    FILE *f;
+
+    opened = file_arg(L, 1, &fd, &f);
+    if(opened < 0)
+	return 3;
+    sum = checksum_new(ct);
+    en = feed_file(fd, f, checksum_cb, sum);
+    if(opened)
+	close(fd);
+    if(en) {
+	checksum_free(sum);
+	lua_pushnil(L);
+	lua_pushstring(L, strerror(en));
+	lua_pushinteger(L, en);
+	return 3;
+    }
+    return finalize_sum(L, sum, lua_toboolean(L, 3));
+}
+
+/* Merkle tree hashing: leaves are hashed in parallel on a thread pool */
+#define TREE_LEAF_SIZE (1024 * 1024)
+
+typedef struct tree_leaf {
+    guchar *buf; /* freed once hashed */
+    gsize len;
+    guint8 digest[64];
+    gsize dlen;
+} tree_leaf;
+
+typedef struct tree_state {
+    GChecksumType ct;
+    gsize leaf_size;
+    GThreadPool *pool;
+    GPtrArray *leaves;
+    tree_leaf *cur; /* leaf being filled */
+    /* to limit memory use, only a few leaves may be queued at a time */
+    GMutex lock;
+    GCond done;
+    int pending, max_pending;
+} tree_state;
+
+static void tree_hash_leaf(gpointer data, gpointer user_data)
+{
+    static const guchar leaf_prefix = 0;
+    tree_leaf *leaf = data;
+    tree_state *st = user_data;
+    checksum *sum = checksum_new(st->ct);
+    checksum_update(sum, &leaf_prefix, 1);
+    checksum_update(sum, leaf->buf, leaf->len);
+    leaf->dlen = sizeof(leaf->digest);
+    checksum_get_digest(sum, leaf->digest, &leaf->dlen);
+    checksum_free(sum);
+    g_free(leaf->buf);
+    leaf->buf = NULL;
+    g_mutex_lock(&st->lock);
+    st->pending--;
+    g_cond_signal(&st->done);
+    g_mutex_unlock(&st->lock);
+}
+
+static void tree_init(tree_state *st, GChecksumType ct, gsize leaf_size,
+		      int threads)
+{
+    memset(st, 0, sizeof(*st));
+    st->ct = ct;
+    st->leaf_size = leaf_size;
+    if(threads <= 0)
+#if GLIB_CHECK_VERSION(2, 36, 0)
+	threads = g_get_num_processors();
+#else
+	threads = 4;
+#endif
+    st->max_pending = 2 * threads;
+    g_mutex_init(&st->lock);
+    g_cond_init(&st->done);
+    st->leaves = g_ptr_array_new_with_free_func(g_free);
+    st->pool = g_thread_pool_new(tree_hash_leaf, st, threads, FALSE, NULL);
+}
+
+/* wait for all queued leaves to be hashed */
+static void tree_wait(tree_state *st)
+{
+    if(st->pool) {
+	g_thread_pool_free(st->pool, FALSE, TRUE);
+	st->pool = NULL;
+    }
+}
+
+static void tree_clear(tree_state *st)
+{
+    tree_wait(st);
+    if(st->leaves) {
+	g_ptr_array_free(st->leaves, TRUE);
+	st->leaves = NULL;
+	g_mutex_clear(&st->lock);
+	g_cond_clear(&st->done);
+    }
+    if(st->cur) {
+	g_free(st->cur->buf);
+	g_free(st->cur);
+	st->cur = NULL;
+    }
+}
+
+static void tree_submit(tree_state *st)
+{
+    g_mutex_lock(&st->lock);
+    while(st->pending >= st->max_pending)
+	g_cond_wait(&st->done, &st->lock);
+    st->pending++;
+    g_mutex_unlock(&st->lock);
+    g_ptr_array_add(st->leaves, st->cur);
+    g_thread_pool_push(st->pool, st->cur, NULL);
+    st->cur = NULL;
+}
+
+static void tree_feed(gpointer data, const guchar *buf, gsize len)
+{
+    tree_state *st = data;
+    while(len) {
+	gsize n;
+	if(!st->cur) {
+	    st->cur = g_new0(tree_leaf, 1);
+	    st->cur->buf = g_malloc(st->leaf_size);
+	}
+	n = MIN(len, st->leaf_size - st->cur->len);
+	memcpy(st->cur->buf + st->cur->len, buf, n);
+	st->cur->len += n;
+	buf += n;
+	len -= n;
+	if(st->cur->len == st->leaf_size)
+	    tree_submit(st);
+    }
+}
+
+/* hash the final leaf, combine all leaves into the root digest, and */
+/* free st's resources; returns the digest length */
+static gsize tree_finish(tree_state *st, guint8 *digest)
+{
+    static const guchar node_prefix = 1;
+    guint8 (*d)[64];
+    guint i, j, n;
+    gsize dlen;
+    /* empty input has a single empty leaf */
+    if(st->cur || !st->leaves->len) {
+	if(!st->cur)
+	    st->cur = g_new0(tree_leaf, 1);
+	tree_submit(st);
+    }
+    tree_wait(st);
+    n = st->leaves->len;
+    d = g_malloc(n * sizeof(*d));
+    dlen = ((tree_leaf *)st->leaves->pdata[0])->dlen;
+    for(i = 0; i < n; i++)
+	memcpy(d[i], ((tree_leaf *)st->leaves->pdata[i])->digest, dlen);
+    while(n > 1) {
+	for(i = j = 0; i + 1 < n; i += 2, j++) {
+	    checksum *sum = checksum_new(st->ct);
+	    gsize l = sizeof(d[j]);
+	    checksum_update(sum, &node_prefix, 1);
+	    checksum_update(sum, d[i], dlen);
+	    checksum_update(sum, d[i + 1], dlen);
+	    checksum_get_digest(sum, d[j], &l);
+	    checksum_free(sum);
+	}
+	/* an odd node is promoted to the next level unchanged */
+	if(i < n)
+	    memcpy(d[j++], d[i], dlen);
+	n = j;
+    }
+    memcpy(digest, d[0], dlen);
+    g_free(d);
+    tree_clear(st);
+    return dlen;
+}
+
+static int free_tree_state(lua_State *L)
+{
+    get_udata(L, 1, st, tree_state);
+    tree_clear(st);
+    return 0;
+}
+
+/***
+Stream tree hash calculation function.
+This function is returned by `tree_sum` to support computing tree
+hashes of streams piecewise.  It is used exactly like `_sum_`:  call
+with string arguments until the stream is complete, and then call with
+an absent or `nil` argument to return the final digest.  Doing so
+invalidates the state, so that the function returns `nil` from that
+point forward.
+@function _tree_sum_
+@see tree_sum
+@tparam[opt] string s The next piece of the string to hash; absent
+ or `nil` to finish
+@tparam[opt] boolean raw True if the digest should be returned in binary
+ form.  Otherwise, return the lower-case hexadecimal-encoded form (ignored
+ if *s* is not `nil`)
+@treturn |nil|string Nothing unless *s* is absent or `nil`.  Otherwise, return
+ the computed digest.
+@raise If the state is invalid, always return `nil`.
+*/
+static int stream_tree_sum(lua_State *L)
+{
+    guint8 digest[64];
+    gsize len;
+    get_udata(L, lua_upvalueindex(1), st, tree_state);
+    if(!st->leaves) {
+	lua_pushnil(L);
+	return 1;
+    }
+    if(lua_gettop(L) > 0 && lua_isstring(L, 1)) {
+	size_t sz;
+	const char *s = luaL_checklstring(L, 1, &sz);
+	tree_feed(st, (const guchar *)s, sz);
+	return 0;
+    }
+    len = tree_finish(st, digest);
+    return push_digest(L, digest, len, lua_toboolean(L, 1));
+}
+
+/***
+Compute a parallel tree hash of a file or stream.
+The input is split into fixed-size leaves, which are hashed on a pool of
+threads, so large inputs can use all available processors.  The result
+is not the same as the plain checksum of the data (e.g. `file_sum`).
+It is the root of a Merkle tree with the following stable format,
+where H is the selected checksum and || is concatenation:
+
+   * The input is split into leaves of *leaf\_size* bytes; the last leaf
+     may be shorter.  Empty input is a single empty leaf.
+   * Each leaf's hash is H(0x00 || leaf).
+   * Each level is reduced by replacing adjacent pairs of hashes, from
+     the start, with H(0x01 || left || right).  An odd hash at the end of
+     a level is carried up unchanged.
+   * The final remaining hash is the result.
+
+The result thus depends on the checksum type and the leaf size.
+@function tree_sum
+@see _tree_sum_
+@see file_sum
+@tparam string|file|number|nil file The file to hash, as for `file_sum`.
+ If `nil`, return a function like `_tree_sum_` to hash a stream piecewise.
+@tparam string type The checksum type, as for `file_sum`
+@tparam[opt] {string=value,...} options Hashing options:
+
+   * **raw**: True if the digest should be returned in binary form.
+     Otherwise, return the lower-case hexadecimal-encoded form (ignored
+     when hashing a stream).
+   * **leaf\_size**: The size of each leaf, in bytes; the default is
+     1048576 (1MB).
+   * **threads**: The maximum number of threads to use; the default is
+     the number of processors.
+@treturn string|function The digest, or a function like `_tree_sum_`.
+@raise Returns `nil`, an error message and the error number if the file
+ could not be opened or read.
+*/
+static int glib_tree_sum(lua_State *L)
+{
+    GChecksumType ct = check_checksum_type(L, 2, 2);
+    lua_Number leaf_size = TREE_LEAF_SIZE;
+    int threads = 0, opened, fd, en;
+    gboolean raw = FALSE;
+    tree_state tst;
+    guint8 digest[64];
+    gsize len;
+    FILE *f;
+
+    if(!lua_isnoneornil(L, 3)) {
+	luaL_checktype(L, 3, LUA_TTABLE);
+	lua_getfield(L, 3, "raw");
+	raw = lua_toboolean(L, -1);
+	lua_getfield(L, 3, "leaf_size");
+	if(!lua_isnil(L, -1))
+	    leaf_size = luaL_checknumber(L, -1);
+	lua_getfield(L, 3, "threads");
+	threads = lua_tonumber(L, -1);
+	lua_pop(L, 3);
+	luaL_argcheck(L, leaf_size >= 1 && leaf_size <= G_MAXINT, 3,
+		      "invalid leaf size");
+    }
+    if(lua_isnoneornil(L, 1)) {
+	alloc_udata(L, st, tree_state);
+	tree_init(st, ct, leaf_size, threads);
+	lua_pushcclosure(L, stream_tree_sum, 1);
+	return 1;
+    }
+    opened = file_arg(L, 1, &fd, &f);
+    if(opened < 0)
+	return 3;
+    tree_init(&tst, ct, leaf_size, threads);
+    en = feed_file(fd, f, tree_feed, &tst);
+    if(opened)
+	close(fd);
+    if(en) {
+	tree_clear(&tst);
+	lua_pushnil(L);
+	lua_pushstring(L, strerror(en));
+	lua_pushinteger(L, en);
+	return 3;
+    }
+    len = tree_finish(&tst, digest);
+    return push_digest(L, digest, len, raw);
+}
+
+/* Non-cryptographic hashes: XXH64, XXH3 (64-bit, default secret and */
+/* seed 0) and CRC-32C; all produce integers rather than digests */
+enum {
+    FASTHASH_XXH64, FASTHASH_XXH3, FASTHASH_CRC32C
+};
+
+#define XXH_P32_1 G_GUINT64_CONSTANT(0x9E3779B1)
+#define XXH_P32_2 G_GUINT64_CONSTANT(0x85EBCA77)
+#define XXH_P32_3 G_GUINT64_CONSTANT(0xC2B2AE3D)
+#define XXH_P64_1 G_GUINT64_CONSTANT(0x9E3779B185EBCA87)
+#define XXH_P64_2 G_GUINT64_CONSTANT(0xC2B2AE3D27D4EB4F)
+#define XXH_P64_3 G_GUINT64_CONSTANT(0x165667B19E3779F9)
+#define XXH_P64_4 G_GUINT64_CONSTANT(0x85EBCA77C2B2AE63)
+#define XXH_P64_5 G_GUINT64_CONSTANT(0x27D4EB2F165667C5)
+
+typedef struct fasthash_state {
+    int type;
+    gboolean done;
+    guint64 total;
+    guint64 acc[8]; /* XXH64 uses 4; CRC-32C uses 1 */
+    guchar buf[256]; /* XXH64 uses 32; CRC-32C uses none */
+    gsize nbuf;
+    int nstripes; /* XXH3 stripes processed in current block */
+    guchar last[64]; /* XXH3 most recently processed stripe */
+} fasthash_state;
+
+static guint64 read64le(const guchar *p)
+{
+    guint64 v;
+    memcpy(&v, p, 8);
+    return GUINT64_FROM_LE(v);
+}
+
+static guint32 read32le(const guchar *p)
+{
+    guint32 v;
+    memcpy(&v, p, 4);
+    return GUINT32_FROM_LE(v);
+}
+
+static guint64 rotl64(guint64 v, int n)
+{
+    return (v << n) | (v >> (64 - n));
+}
+
+static guint64 xxh64_round(guint64 acc, guint64 v)
+{
+    return rotl64(acc + v * XXH_P64_2, 31) * XXH_P64_1;
+}
+
+static guint64 xxh64_avalanche(guint64 h)
+{
+    h ^= h >> 33;
+    h *= XXH_P64_2;
+    h ^= h >> 29;
+    h *= XXH_P64_3;
+    return h ^ (h >> 32);
+}
+
+/* consume all complete 32-byte stripes; returns bytes consumed */
+static gsize xxh64_stripes(guint64 *v, const guchar *p, gsize len)
+{
+    gsize i;
+    for(i = 0; i + 32 <= len; i += 32) {
+	v[0] = xxh64_round(v[0], read64le(p + i));
+	v[1] = xxh64_round(v[1], read64le(p + i + 8));
+	v[2] = xxh64_round(v[2], read64le(p + i + 16));
+	v[3] = xxh64_round(v[3], read64le(p + i + 24));
+    }
+    return i;
+}
+
+/* v is only used if total >= 32; p/len is the remaining (< 32) bytes */
+static guint64 xxh64_finish(const guint64 *v, guint64 total,
+			    const guchar *p, gsize len)
+{
+    guint64 h;
+    int i;
+    if(total >= 32) {
+	h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) +
+	    rotl64(v[3], 18);
+	for(i = 0; i < 4; i++)
+	    h = (h ^ xxh64_round(0, v[i])) * XXH_P64_1 + XXH_P64_4;
+    } else
+	h = XXH_P64_5;
+    h += total;
+    for(; len >= 8; len -= 8, p += 8)
+	h = rotl64(h ^ xxh64_round(0, read64le(p)), 27) * XXH_P64_1 +
+	    XXH_P64_4;
+    if(len >= 4) {
+	h = rotl64(h ^ read32le(p) * XXH_P64_1, 23) * XXH_P64_2 + XXH_P64_3;
+	len -= 4;
+	p += 4;
+    }
+    for(; len; len--, p++)
+	h = rotl64(h ^ *p * XXH_P64_5, 11) * XXH_P64_1;
+    return xxh64_avalanche(h);
+}
+
+static const guchar xxh3_secret[192] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c,
+    0xf7, 0x21, 0xad, 0x1c, 0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+    0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f, 0xcb, 0x79, 0xe6, 0x4e,
+    0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6,
+    0x81, 0x3a, 0x26, 0x4c, 0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+    0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3, 0x71, 0x64, 0x48, 0x97,
+    0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7,
+    0xc7, 0x0b, 0x4f, 0x1d, 0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+    0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64, 0xea, 0xc5, 0xac, 0x83,
+    0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26,
+    0x29, 0xd4, 0x68, 0x9e, 0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+    0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce, 0x45, 0xcb, 0x3a, 0x8f,
+    0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+/* XXH3's stripes are 64 bytes; 16 stripes (one per 8 bytes of the */
+/* secret) form a block, after which the accumulators are scrambled */
+#define XXH3_STRIPES 16
+
+static guint64 mul128_fold64(guint64 a, guint64 b)
+{
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 p = (unsigned __int128)a * b;
+    return (guint64)p ^ (guint64)(p >> 64);
+#else
+    guint64 lo_lo = (a & 0xffffffff) * (b & 0xffffffff);
+    guint64 hi_lo = (a >> 32) * (b & 0xffffffff);
+    guint64 lo_hi = (a & 0xffffffff) * (b >> 32);
+    guint64 hi_hi = (a >> 32) * (b >> 32);
+    guint64 cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+    guint64 hi = hi_hi + (hi_lo >> 32) + (cross >> 32);
+    return ((cross << 32) | (lo_lo & 0xffffffff)) ^ hi;
+#endif
+}
+
+static guint64 xxh3_avalanche(guint64 h)
+{
+    h ^= h >> 37;
+    h *= G_GUINT64_CONSTANT(0x165667919E3779F9);
+    return h ^ (h >> 32);
+}
+
+static guint64 xxh3_mix16(const guchar *p, const guchar *sec)
+{
+    return mul128_fold64(read64le(p) ^ read64le(sec),
+			 read64le(p + 8) ^ read64le(sec + 8));
+}
+
+/* hash of inputs up to 240 bytes, which are never streamed */
+static guint64 xxh3_short(const guchar *p, gsize len)
+{
+    const guchar *sec = xxh3_secret;
+    guint64 h;
+    gsize i;
+    if(len > 128) {
+	h = len * XXH_P64_1;
+	for(i = 0; i < 8; i++)
+	    h += xxh3_mix16(p + 16 * i, sec + 16 * i);
+	h = xxh3_avalanche(h);
+	for(i = 8; i < len / 16; i++)
+	    h += xxh3_mix16(p + 16 * i, sec + 16 * (i - 8) + 3);
+	return xxh3_avalanche(h + xxh3_mix16(p + len - 16, sec + 119));
+    }
+    if(len > 16) {
+	h = len * XXH_P64_1;
+	if(len > 32) {
+	    if(len > 64) {
+		if(len > 96) {
+		    h += xxh3_mix16(p + 48, sec + 96);
+		    h += xxh3_mix16(p + len - 64, sec + 112);
+		}
+		h += xxh3_mix16(p + 32, sec + 64);
+		h += xxh3_mix16(p + len - 48, sec + 80);
+	    }
+	    h += xxh3_mix16(p + 16, sec + 32);
+	    h += xxh3_mix16(p + len - 32, sec + 48);
+	}
+	h += xxh3_mix16(p, sec);
+	h += xxh3_mix16(p + len - 16, sec + 16);
+	return xxh3_avalanche(h);
+    }
+    if(len > 8) {
+	guint64 lo = read64le(p) ^ (read64le(sec + 24) ^ read64le(sec + 32));
+	guint64 hi = read64le(p + len - 8) ^
+	    (read64le(sec + 40) ^ read64le(sec + 48));
+	return xxh3_avalanche(len + GUINT64_SWAP_LE_BE(lo) + hi +
+			      mul128_fold64(lo, hi));
+    }
+    if(len >= 4) {
+	h = (read32le(p + len - 4) + ((guint64)read32le(p) << 32)) ^
+	    (read64le(sec + 8) ^ read64le(sec + 16));
+	h ^= rotl64(h, 49) ^ rotl64(h, 24);
+	h *= G_GUINT64_CONSTANT(0x9FB21C651E98DF25);
+	h ^= (h >> 35) + len;
+	h *= G_GUINT64_CONSTANT(0x9FB21C651E98DF25);
+	return h ^ (h >> 28);
+    }
+    if(len)
+	return xxh64_avalanche(((guint32)p[0] << 16 | (guint32)p[len >> 1] << 24 |
+				p[len - 1] | (guint32)len << 8) ^
+			       (guint64)(read32le(sec) ^ read32le(sec + 4)));
+    return xxh64_avalanche(read64le(sec + 56) ^ read64le(sec + 64));
+}
+
+static void xxh3_init(guint64 *acc)
+{
+    acc[0] = XXH_P32_3;
+    acc[1] = XXH_P64_1;
+    acc[2] = XXH_P64_2;
+    acc[3] = XXH_P64_3;
+    acc[4] = XXH_P64_4;
+    acc[5] = XXH_P32_2;
+    acc[6] = XXH_P64_5;
+    acc[7] = XXH_P32_1;
+}
+
+static void xxh3_stripe(guint64 *acc, const guchar *p, const guchar *sec)
+{
+    int i;
+    for(i = 0; i < 8; i++) {
+	guint64 v = read64le(p + 8 * i);
+	guint64 k = v ^ read64le(sec + 8 * i);
+	acc[i ^ 1] += v;
+	acc[i] += (k & 0xffffffff) * (k >> 32);
+    }
+}
+
+static void xxh3_scramble(guint64 *acc)
+{
+    int i;
+    for(i = 0; i < 8; i++) {
+	guint64 a = acc[i];
+	a ^= a >> 47;
+	a ^= read64le(xxh3_secret + 128 + 8 * i);
+	acc[i] = a * XXH_P32_1;
+    }
+}
+
+/* process n complete stripes, continuing the current block */
+static void xxh3_stripes(guint64 *acc, int *nstripes, const guchar *p,
+			 gsize n)
+{
+    for(; n; n--, p += 64) {
+	xxh3_stripe(acc, p, xxh3_secret + 8 * *nstripes);
+	if(++*nstripes == XXH3_STRIPES) {
+	    xxh3_scramble(acc);
+	    *nstripes = 0;
+	}
+    }
+}
+
+/* finish a long hash given the final 64 bytes of input */
+static guint64 xxh3_long_finish(guint64 *acc, const guchar *last,
+				guint64 total)
+{
+    guint64 h = total * XXH_P64_1;
+    int i;
+    xxh3_stripe(acc, last, xxh3_secret + 192 - 64 - 7);
+    for(i = 0; i < 4; i++)
+	h += mul128_fold64(acc[2 * i] ^ read64le(xxh3_secret + 11 + 16 * i),
+			   acc[2 * i + 1] ^
+			   read64le(xxh3_secret + 11 + 16 * i + 8));
+    return xxh3_avalanche(h);
+}
+
+/* filled in by luaopen_glib() */
+static guint32 crc32c_table[256];
+
+static void crc32c_init_table(void)
+{
+    guint32 i, j, c;
+    for(i = 0; i < 256; i++) {
+	for(c = i, j = 0; j < 8; j++)
+	    c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+	crc32c_table[i] = c;
+    }
+}
+
+#ifdef LGLIB_X86_64
+__attribute__((target("sse4.2")))
+static guint32 crc32c_sse42(guint32 crc, const guchar *p, gsize len)
+{
+    guint64 c;
+    for(; len && ((gsize)p & 7); len--, p++)
+	crc = _mm_crc32_u8(crc, *p);
+    for(c = crc; len >= 8; len -= 8, p += 8) {
+	guint64 v;
+	memcpy(&v, p, 8);
+	c = _mm_crc32_u64(c, v);
+    }
+    for(crc = c; len; len--, p++)
+	crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+#endif
+
+/* crc is not pre- or post-inverted */
+static guint32 crc32c_update(guint32 crc, const guchar *p, gsize len)
+{
+#ifdef LGLIB_X86_64
+    if(cpu_has(CPU_SSE42))
+	return crc32c_sse42(crc, p, len);
+#endif
+    for(; len; len--, p++)
+	crc = crc32c_table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static void fasthash_init(fasthash_state *st, int type)
+{
+    memset(st, 0, sizeof(*st));
+    st->type = type;
+    switch(type) {
+      case FASTHASH_XXH64:
+	st->acc[0] = XXH_P64_1 + XXH_P64_2;
+	st->acc[1] = XXH_P64_2;
+	st->acc[3] = -XXH_P64_1;
+	break;
+      case FASTHASH_XXH3:
+	xxh3_init(st->acc);
+	break;
+      case FASTHASH_CRC32C:
+	st->acc[0] = 0xffffffff;
+	break;
+    }
+}
+
+static void fasthash_update(fasthash_state *st, const guchar *p, gsize len)
+{
+    gsize n;
+    st->total += len;
+    switch(st->type) {
+      case FASTHASH_XXH64:
+	if(st->nbuf) {
+	    n = MIN(len, 32 - st->nbuf);
+	    memcpy(st->buf + st->nbuf, p, n);
+	    st->nbuf += n;
+	    p += n;
+	    len -= n;
+	    if(st->nbuf < 32)
+		return;
+	    xxh64_stripes(st->acc, st->buf, 32);
+	    st->nbuf = 0;
+	}
+	n = xxh64_stripes(st->acc, p, len);
+	memcpy(st->buf, p + n, len - n);
+	st->nbuf = len - n;
+	break;
+      case FASTHASH_XXH3:
+	/* a full buffer is only processed once more input arrives, so */
+	/* the final stripe and short inputs are always still buffered */
+	while(len) {
+	    if(st->nbuf == sizeof(st->buf)) {
+		xxh3_stripes(st->acc, &st->nstripes, st->buf, 4);
+		memcpy(st->last, st->buf + 192, 64);
+		st->nbuf = 0;
+	    }
+	    /* process input directly while it doesn't contain the end */
+	    if(!st->nbuf && len > sizeof(st->buf)) {
+		n = (len - 1) / 64;
+		xxh3_stripes(st->acc, &st->nstripes, p, n);
+		memcpy(st->last, p + 64 * (n - 1), 64);
+		p += 64 * n;
+		len -= 64 * n;
+	    }
+	    n = MIN(len, sizeof(st->buf) - st->nbuf);
+	    memcpy(st->buf + st->nbuf, p, n);
+	    st->nbuf += n;
+	    p += n;
+	    len -= n;
+	}
+	break;
+      case FASTHASH_CRC32C:
+	st->acc[0] = crc32c_update(st->acc[0], p, len);
+	break;
+    }
 }
 
-/*********************************************************************/
-/***
-Data Checksums
-@section Data Checksums
-*/
-
-typedef struct sumstate {
-    GChecksum *sum;
-} sumstate;
-
-static int free_sumstate(lua_State *L)
+static guint64 fasthash_final(fasthash_state *st)
 {
-    get_udata(L, 1, st, sumstate);
-    if(st->sum)
-	g_checksum_free(st->sum);
-    return 0;
+    st->done = TRUE;
+    switch(st->type) {
+      case FASTHASH_XXH64:
+	return xxh64_finish(st->acc, st->total, st->buf, st->nbuf);
+      case FASTHASH_XXH3:
+	if(st->total <= 240)
+	    return xxh3_short(st->buf, st->total);
+	{
+	    gsize n = (st->nbuf - 1) / 64;
+	    guchar last[64];
+	    xxh3_stripes(st->acc, &st->nstripes, st->buf, n);
+	    if(st->nbuf >= 64)
+		return xxh3_long_finish(st->acc, st->buf + st->nbuf - 64,
+					st->total);
+	    memcpy(last, st->last + st->nbuf, 64 - st->nbuf);
+	    memcpy(last + 64 - st->nbuf, st->buf, st->nbuf);
+	    return xxh3_long_finish(st->acc, last, st->total);
+	}
+      default:
+	return (guint32)~st->acc[0];
+    }
 }
 
-/* return type is lifted from cmorris' lua-glib */
-static int finalize_sum(lua_State *L, GChecksum *sum, gboolean raw)
+static int push_fasthash(lua_State *L, fasthash_state *st, gboolean hex)
 {
-    if(raw) {
-        guint8 digest[64];
-        gsize digest_len = 64;
-        g_checksum_get_digest(sum, digest, &digest_len);
-        lua_pushlstring(L, (char *)digest, digest_len);
-    } else {
-        const gchar *digest = g_checksum_get_string(sum);
-        lua_pushstring(L, digest);
+    guint64 h = fasthash_final(st);
+    if(hex) {
+	/* big-endian, as printed by xxhsum and most CRC tools */
+	int nd = st->type == FASTHASH_CRC32C ? 4 : 8;
+	guint8 d[8];
+	int i;
+	for(i = 0; i < nd; i++)
+	    d[i] = h >> (8 * (nd - 1 - i));
+	return push_digest(L, d, nd, FALSE);
     }
-    g_checksum_free(sum);
+    lua_pushinteger(L, (lua_Integer)h);
     return 1;
 }
 
 /***
-Stream checksum/hash calculation function type.
-This function is returned by `md5sum`, `sha1sum`, or `sha256sum` to support
-computing stream checksums piecewise.  Simply call with string arguments,
-until the stream is complete.  Then, call with an absent or `nil`
-argument to return the final checksum.  Doing so invalidates
-the state, so that the function returns an error from that point
-forward.
-@function _sum_
-@see md5sum
-@see sha1sum
-@see sha256sum
-@tparam[opt] string s The next piece of the string to checksum; absent
- or `nil` to finish checksum
-@tparam[opt] boolean raw True if checksum should be returned in binary
- form.  Otherwise, return the lower-case hexadecimal-encoded form (ignored
- if *s* is not `nil`)
-@treturn |nil|string Nothing unless *s* is absent or `nil`.  Otherwise, return
- the computed checksum.
+Stream non-cryptographic hash calculation function.
+This function is returned by `xxh64`, `xxh3` or `crc32c` to support
+computing hashes of streams piecewise.  It is used like `_sum_`, but
+the result is an integer.
+@function _hash_
+@see xxh64
+@see xxh3
+@see crc32c
+@tparam[opt] string s The next piece of the string to hash; absent
+ or `nil` to finish
+@tparam[opt] boolean hex True if the hash should be returned as a
+ hexadecimal string rather than an integer (ignored if *s* is not `nil`)
+@treturn |nil|number|string Nothing unless *s* is absent or `nil`.
+ Otherwise, return the computed hash.
 @raise If the state is invalid, always return `nil`.
-@usage
-sumf = glib.md5sum()
-while true do
-  buf = inf:read(4096)
-  if not buf then break end
-  sumf(buf)
-end
-sum = sumf()
 */
-static int stream_sum(lua_State *L)
+static int stream_fasthash(lua_State *L)
 {
-    GChecksum *sum;
-    get_udata(L, lua_upvalueindex(1), st, sumstate);
-    if(!st->sum) {
+    get_udata(L, lua_upvalueindex(1), st, fasthash_state);
+    if(st->done) {
 	lua_pushnil(L);
 	return 1;
     }
     if(lua_gettop(L) > 0 && lua_isstring(L, 1)) {
 	size_t sz;
 	const char *s = luaL_checklstring(L, 1, &sz);
-	g_checksum_update(st->sum, (const guchar *)s, sz);
+	fasthash_update(st, (const guchar *)s, sz);
 	return 0;
     }
-    sum = st->sum;
-    st->sum = NULL;
-    return finalize_sum(L, sum, lua_toboolean(L, 1));
+    return push_fasthash(L, st, lua_toboolean(L, 1));
 }
 
-static int glib_sum(lua_State *L, GChecksumType ct)
+static int glib_fasthash(lua_State *L, int type)
 {
     size_t sz;
     const char *s;
-    GChecksum *sum;
+    fasthash_state st;
 
     if(lua_gettop(L) == 0) {
-	alloc_udata(L, st, sumstate);
-	st->sum = g_checksum_new(ct);
-	lua_pushcclosure(L, stream_sum, 1);
+	alloc_udata(L, stp, fasthash_state);
+	fasthash_init(stp, type);
+	lua_pushcclosure(L, stream_fasthash, 1);
 	return 1;
     }
-    sum = g_checksum_new(ct);
     s = luaL_checklstring(L, 1, &sz);
-    g_checksum_update(sum, (const guchar *)s, sz);
-    return finalize_sum(L, sum, lua_toboolean(L, 2));
+    fasthash_init(&st, type);
+    fasthash_update(&st, (const guchar *)s, sz);
+    return push_fasthash(L, &st, lua_toboolean(L, 2));
 }
 
 /***
-Compute MD5 checksum of a string.
-This is a wrapper for `g_checksum_new()` and friends.
-@function md5sum
-@see _sum_
-@tparam[opt] string s The data to checksum.  If absent, return a
- function like `_sum_` to checksum a stream piecewise.
-@tparam[optchain] boolean raw True if checksum should be returned in binary
- form.  Otherwise, return the lower-case hexadecimal-encoded form (ignored
- if *s* is `nil`)
-@treturn string|function The MD5 checksum or a stream converter function.
+Compute the XXH64 hash of a string.
+This is a fast non-cryptographic hash, suitable for hash tables and
+cache keys, but not for security purposes.  The seed is 0.
+@function xxh64
+@see _hash_
+@tparam[opt] string s The data to hash.  If absent, return a function
+ like `_hash_` to hash a stream piecewise.
+@tparam[optchain] boolean hex True if the hash should be returned as a
+ 16-digit hexadecimal string rather than an integer.  Lua versions
+ before 5.3 cannot represent all 64-bit integers exactly, so this
+ should be used there when the full hash is needed.
+@treturn number|string|function The hash, or a stream hash function.
+ In Lua 5.3 and later, values of 2^63 or more are returned as negative
+ integers.
 */
-static int glib_md5sum(lua_State *L)
+static int glib_xxh64(lua_State *L)
 {
-    return glib_sum(L, G_CHECKSUM_MD5);
+    return glib_fasthash(L, FASTHASH_XXH64);
 }
 
 /***
-Compute SHA1 checksum of a string.
-This is a wrapper for `g_checksum_new()` and friends.
-@function sha1sum
-@see _sum_
-@tparam[opt] string s The data to checksum.  If absent, return a
- function like `_sum_` to checksum a stream piecewise.
-@tparam[optchain] boolean raw True if checksum should be returned in binary
- form.  Otherwise, return the lower-case hexadecimal-encoded form (ignored
- if *s* is `nil`)
-@treturn string|function The SHA1 checksum or a stream converter function.
+Compute the XXH3 hash of a string.
+This is the 64-bit XXH3 hash with the default secret and a seed of 0.
+It is generally faster than `xxh64`, especially for short strings.
+@function xxh3
+@see _hash_
+@tparam[opt] string s The data to hash.  If absent, return a function
+ like `_hash_` to hash a stream piecewise.
+@tparam[optchain] boolean hex True if the hash should be returned as a
+ 16-digit hexadecimal string rather than an integer, as with `xxh64`.
+@treturn number|string|function The hash, or a stream hash function.
 */
-static int glib_sha1sum(lua_State *L)
+static int glib_xxh3(lua_State *L)
 {
-    return glib_sum(L, G_CHECKSUM_SHA1);
+    return glib_fasthash(L, FASTHASH_XXH3);
 }
 
 /***
-Compute SHA256 checksum of a string.
-This is a wrapper for `g_checksum_new()` and friends.
-@function sha256sum
-@see _sum_
+Compute the CRC-32C (Castagnoli) checksum of a string.
+The SSE4.2 CRC instruction is used if available.
+@function crc32c
+@see _hash_
 @tparam[opt] string s The data to checksum.  If absent, return a
- function like `_sum_` to checksum a stream piecewise.
-@tparam[optchain] boolean raw True if checksum should be returned in binary
- form.  Otherwise, return the lower-case hexadecimal-encoded form (ignored
- if *s* is `nil`)
-@treturn string|function The SHA256 checksum or a stream converter function.
+ function like `_hash_` to checksum a stream piecewise.
+@tparam[optchain] boolean hex True if the checksum should be returned as
+ an 8-digit hexadecimal string rather than an integer.
+@treturn number|string|function The checksum, or a stream checksum
+ function.
 */
-static int glib_sha256sum(lua_State *L)
+static int glib_crc32c(lua_State *L)
 {
-    return glib_sum(L, G_CHECKSUM_SHA256);
+    return glib_fasthash(L, FASTHASH_CRC32C);
 }
 
 #if GLIB_CHECK_VERSION(2, 30, 0)
@@ -1646,15 +6205,10 @@ static int free_hmacstate(lua_State *L)
 /* return type is lifted from cmorris' lua-glib */
 static int finalize_hmac(lua_State *L, GHmac *sum, gboolean raw)
 {
-    if(raw) {
-        guint8 digest[64];
-        gsize digest_len = 64;
-        g_hmac_get_digest(sum, digest, &digest_len);
-        lua_pushlstring(L, (char *)digest, digest_len);
-    } else {
-        const gchar *digest = g_hmac_get_string(sum);
-        lua_pushstring(L, digest);
-    }
+    guint8 digest[64];
+    gsize digest_len = 64;
+    g_hmac_get_digest(sum, digest, &digest_len);
+    push_digest(L, digest, digest_len, raw);
     g_hmac_unref(sum);
     return 1;
 }
@@ -1784,6 +6338,149 @@ static int glib_sha256hmac(lua_State *L)
 {
     return glib_hmac(L, G_CHECKSUM_SHA256);
 }
+
+typedef struct hmac_key_state {
+    GHmac *hmac; /* keyed, but never updated; copied for each use */
+} hmac_key_state;
+
+static int free_hmac_key_state(lua_State *L)
+{
+    get_udata(L, 1, st, hmac_key_state);
+    if(st->hmac) {
+	g_hmac_unref(st->hmac);
+	st->hmac = NULL;
+    }
+    return 0;
+}
+
+/***
+Create a reusable HMAC key.
+The key is processed once, and the result is copied for each message,
+which is faster than `md5hmac` and friends when signing many messages
+with the same key.
+
+This is only available with GLib 2.30 or later.
+@function hmac_key
+@tparam string type The digest type:  `md5`, `sha1`, `sha256`, `sha512`
+ (GLib 2.42 or later) or `sha384` (GLib 2.52 or later)
+@tparam string key HMAC key
+@treturn hmac_key The key object
+*/
+static int glib_hmac_key(lua_State *L)
+{
+    GChecksumType ct = check_checksum_type(L, 1, 1);
+    size_t keysz;
+    const char *key = luaL_checklstring(L, 2, &keysz);
+#if !GLIB_CHECK_VERSION(2, 42, 0)
+    /* GChecksum may support this, but GHmac does not yet */
+    if(ct != G_CHECKSUM_MD5 && ct != G_CHECKSUM_SHA1 &&
+       ct != G_CHECKSUM_SHA256)
+	return luaL_argerror(L, 1, "invalid checksum type");
+#endif
+    alloc_udata(L, st, hmac_key_state);
+    st->hmac = g_hmac_new(ct, (const guchar *)key, keysz);
+    return 1;
+}
+
+/***
+@type hmac_key
+*/
+/***
+Compute the HMAC digest of a string.
+@function hmac_key:sign
+@tparam string s The data to digest
+@tparam[opt] boolean raw True if digest should be returned in binary
+ form.  Otherwise, return the lower-case hexadecimal-encoded form.
+@treturn string The digest
+*/
+static int hmac_key_sign(lua_State *L)
+{
+    size_t sz;
+    const char *s = luaL_checklstring(L, 2, &sz);
+    GHmac *sum;
+    get_udata(L, 1, st, hmac_key_state);
+    sum = g_hmac_copy(st->hmac);
+    g_hmac_update(sum, (const guchar *)s, sz);
+    return finalize_hmac(L, sum, lua_toboolean(L, 3));
+}
+
+/***
+Verify the HMAC digest of a string.
+The comparison takes the same amount of time regardless of where the
+digests differ, so it does not reveal the correct digest to an attacker.
+@function hmac_key:verify
+@tparam string s The data to digest
+@tparam string mac The expected digest, in either binary or hexadecimal
+ form
+@treturn boolean True if *mac* is the digest of *s*
+*/
+static int hmac_key_verify(lua_State *L)
+{
+    size_t sz, macsz, i;
+    const char *s = luaL_checklstring(L, 2, &sz);
+    const char *mac = luaL_checklstring(L, 3, &macsz);
+    guint8 digest[64];
+    gsize digest_len = 64;
+    int diff = 0;
+    GHmac *sum;
+    get_udata(L, 1, st, hmac_key_state);
+    sum = g_hmac_copy(st->hmac);
+    g_hmac_update(sum, (const guchar *)s, sz);
+    g_hmac_get_digest(sum, digest, &digest_len);
+    g_hmac_unref(sum);
+    if(macsz == digest_len)
+	for(i = 0; i < digest_len; i++)
+	    diff |= digest[i] ^ (guchar)mac[i];
+    else if(macsz == 2 * digest_len)
+	for(i = 0; i < digest_len; i++) {
+	    int hi = hex_value(mac[2 * i]), lo = hex_value(mac[2 * i + 1]);
+	    /* invalid hex digits are -1 */
+	    diff |= (hi < 0) | (lo < 0);
+	    diff |= ((hi & 0xf) << 4 | (lo & 0xf)) ^ digest[i];
+	}
+    else
+	diff = 1;
+    lua_pushboolean(L, !diff);
+    return 1;
+}
+
+/***
+Create a copy of the key.
+This is a wrapper for `g_hmac_copy()`.
+@function hmac_key:copy
+@treturn hmac_key The new key object
+*/
+static int hmac_key_copy(lua_State *L)
+{
+    get_udata(L, 1, st, hmac_key_state);
+    alloc_udata(L, nst, hmac_key_state);
+    nst->hmac = g_hmac_copy(st->hmac);
+    return 1;
+}
+
+/***
+Start computing the HMAC digest of a stream.
+@function hmac_key:stream
+@see _hmac_
+@treturn function A function like `_hmac_` to digest a stream piecewise.
+*/
+static int hmac_key_stream(lua_State *L)
+{
+    get_udata(L, 1, st, hmac_key_state);
+    alloc_udata(L, hst, hmacstate);
+    hst->sum = g_hmac_copy(st->hmac);
+    lua_pushcclosure(L, stream_hmac, 1);
+    return 1;
+}
+
+static luaL_Reg hmac_key_state_funcs[] = {
+    {"sign", hmac_key_sign},
+    {"verify", hmac_key_verify},
+    {"copy", hmac_key_copy},
+    {"stream", hmac_key_stream},
+    {"__gc", free_hmac_key_state},
+    {NULL, NULL}
+};
 #endif
 
 /*********************************************************************/
@@ -3043,6 +7740,53 @@ static int qsort_fun(gconstpointer _a, gconstpointer _b, gpointer l)
     return cmp;
 }
 
+/* move elements of table at idx to sorted positions */
+/* ind[0..nind-1] are the sorted 1-based indices; ind has room for 2 * nind */
+static void permute_table(lua_State *L, int idx, size_t *ind, size_t nind)
+{
+    size_t i;
+    /* first find where each element will end up */
+    for(i = 0; i < nind; i++)
+	ind[nind + ind[i] - 1] = i + 1;
+    /* now do one element at a time, chaining until done */
+    /* this way, only two elements are on stack at once */
+    for(i = 0; i < nind; i++) {
+	size_t j = ind[i], k;
+	if(!j || j == i + 1)
+	    continue; /* flagged as done, or already in place */
+	/* x = a[i + 1] */
+	lua_pushinteger(L, i + 1);
+	lua_gettable(L, idx);
+	/* a[i + 1] = a[j] */
+	lua_pushinteger(L, i + 1);
+	lua_pushinteger(L, j);
+	lua_gettable(L, idx);
+	lua_settable(L, idx);
+	ind[i] = 0; /* mark as done */
+	/* shuffle around */
+	j = i + 1; /* j is what's on top of stack */
+	do {
+	    k = ind[nind + j - 1]; /* k is where it needs to go */
+	    ind[nind + j - 1] = 0; /* flag it as empty */
+	    if(ind[nind + k - 1]) { /* if not empty */
+		/* y = a[k] */
+		lua_pushinteger(L, k);
+		lua_gettable(L, idx);
+		/* swap(x, y) */
+		lua_pushvalue(L, -2);
+		lua_remove(L, -3);
+		j = k;
+	    } /* else y = x; x = empty */
+	    /* a[k] = y */
+	    lua_pushinteger(L, k);
+	    lua_pushvalue(L, -2);
+	    lua_remove(L, -3);
+	    lua_settable(L, idx);
+	    ind[k - 1] = 0; /* mark as done */
+	} while(ind[nind + k - 1]); /* repeat until x empty */
+    }
+}
+
 /***
 Sort a table using a stable quicksort algorithm.
 This is a wrapper for `g_qsort_with_data()`.  This sorts a table
@@ -3078,47 +7822,71 @@ static int glib_qsort(lua_State *L)
     for(i = 0; i < nind; i++)
 	ind[i] = i + 1;
     g_qsort_with_data(ind, nind, sizeof(*ind), qsort_fun, L);
-    /* now move the actual values around */
-    /* first find where each element will end up */
-    for(i = 0; i < nind; i++)
-	ind[nind + ind[i] - 1] = i + 1;
-    /* now do one element at a time, chaining until done */
-    /* this way, only two elements are on stack at once */
+    permute_table(L, 1, ind, nind);
+    g_free(ind);
+    return 0;
+}
+
+static int collate_key_cmp(gconstpointer _a, gconstpointer _b, gpointer k)
+{
+    const size_t *a = _a, *b = _b;
+    gchar **keys = k;
+    int c = strcmp(keys[*a - 1], keys[*b - 1]);
+    if(c)
+	return c;
+    return *a < *b ? -1 : *a > *b;
+}
+
+/***
+Sort a table of strings in collation order.
+This sorts a table of UTF-8 strings in-place, in the same order as
+`qsort` would using `utf8_collate` as the comparison function.  However,
+the collation key of each string is computed only once, using
+`g_utf8_collate_key()` (or `g_utf8_collate_key_for_filename()`), and
+the keys are compared directly.  This is much faster than
+calling `utf8_collate` for each comparison, and does not require building
+a table of keys in Lua.  Equivalent strings retain their original
+relative order.
+@function collate_sort
+@see qsort
+@see utf8_collate_key
+@see utf8_collate_key_for_filename
+@tparam table t Table of strings to sort
+@tparam[opt] boolean filename If true, use the collation order for file
+ names, as with `utf8_collate_key_for_filename`.
+*/
+static int glib_collate_sort(lua_State *L)
+{
+    size_t nind, i, sz;
+    size_t *ind;
+    gchar **keys;
+    const char *s;
+    gboolean fn = lua_toboolean(L, 2);
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    nind = lua_rawlen(L, 1);
+    keys = g_new(gchar *, nind);
     for(i = 0; i < nind; i++) {
-	size_t j = ind[i], k;
-	if(!j || j == i + 1)
-	    continue; /* flagged as done, or already in place */
-	/* x = a[i + 1] */
-	lua_pushinteger(L, i + 1);
-	lua_gettable(L, 1);
-	/* a[i + 1] = a[j] */
-	lua_pushinteger(L, i + 1);
-	lua_pushinteger(L, j);
-	lua_gettable(L, 1);
-	lua_settable(L, 1);
-	ind[i] = 0; /* mark as done */
-	/* shuffle around */
-	j = i + 1; /* j is what's on top of stack */
-	do {
-	    k = ind[nind + j - 1]; /* k is where it needs to go */
-	    ind[nind + j - 1] = 0; /* flag it as empty */
-	    if(ind[nind + k - 1]) { /* if not empty */
-		/* y = a[k] */
-		lua_pushinteger(L, k);
-		lua_gettable(L, 1);
-		/* swap(x, y) */
-		lua_pushvalue(L, -2);
-		lua_remove(L, -3);
-		j = k;
-	    } /* else y = x; x = empty */
-	    /* a[k] = y */
-	    lua_pushinteger(L, k);
-	    lua_pushvalue(L, -2);
-	    lua_remove(L, -3);
-	    lua_settable(L, 1);
-	    ind[k - 1] = 0; /* mark as done */
-	} while(ind[nind + k - 1]); /* repeat until x empty */
+	lua_rawgeti(L, 1, i + 1);
+	s = lua_tolstring(L, -1, &sz);
+	if(!s) {
+	    while(i > 0)
+		g_free(keys[--i]);
+	    g_free(keys);
+	    return luaL_argerror(L, 1, "table of strings expected");
+	}
+	keys[i] = fn ? g_utf8_collate_key_for_filename(s, sz) :
+		       g_utf8_collate_key(s, sz);
+	lua_pop(L, 1);
     }
+    ind = g_malloc(nind * sizeof(*ind) * 2);
+    for(i = 0; i < nind; i++)
+	ind[i] = i + 1;
+    g_qsort_with_data(ind, nind, sizeof(*ind), collate_key_cmp, keys);
+    for(i = 0; i < nind; i++)
+	g_free(keys[i]);
+    g_free(keys);
+    permute_table(L, 1, ind, nind);
     g_free(ind);
     return 0;
 }
@@ -9664,6 +14432,9 @@ static luaL_Reg lua_funcs[] = {
     /* no support for String Utility Functions */
     /* Character Set Conversion */
     fent(convert),
+    fent(convert_batch),
+    fent(convert_cache),
+    fent(convert_flush),
     /* Unicode Manipulation */
     fent(validate),
     fent(isalpha),
@@ -9701,9 +14472,13 @@ static luaL_Reg lua_funcs[] = {
     /* the proper way to support the rest would be to make unicode strings */
     /* a first-class type.  Not happening here, though */
     /* instead, most are just dropped */
+    fent(utf8_runs),
+    fent(utf8_segments),
     fent(utf8_sub),
     fent(utf8_len),
+    fent(utf8_index),
     fent(utf8_validate),
+    fent(utf8_window),
     fent(utf8_strup),
     fent(utf8_strdown),
     fent(utf8_casefold),
@@ -9721,15 +14496,27 @@ static luaL_Reg lua_funcs[] = {
     /* Base64 Encoding */
     fent(base64_encode),
     fent(base64_decode),
+    fent(hex_encode),
+    fent(hex_decode),
+    fent(base32_encode),
+    fent(base32_decode),
     /* Data Checksums */
     fent(md5sum),
     fent(sha1sum),
     fent(sha256sum),
+    fent(multisum),
+    fent(sum_batch),
+    fent(file_sum),
+    fent(tree_sum),
+    fent(xxh64),
+    fent(xxh3),
+    fent(crc32c),
 #if GLIB_CHECK_VERSION(2, 30, 0)
     /* Secure HMAC Digests */
     fent(md5hmac),
     fent(sha1hmac),
     fent(sha256hmac),
+    fent(hmac_key),
 #endif
     /* Internationalization */
     /* technically GNU gettext, not glib */
@@ -9783,6 +14570,7 @@ static luaL_Reg lua_funcs[] = {
     /* atext is unsafe/deprecated */
     /* g_parse_debug_string is also somewhat internal-use */
     fent(qsort),
+    fent(collate_sort),
     fent(cmp),
     /* Lexical Scanner is not supported */
     /* it is fairly unconfigurable and hard to bind to Lua */
@@ -9858,6 +14646,16 @@ int luaopen_glib(lua_State *L)
     /*        uri_reserved_chars_* (5) */
     /*        key_file_desktop (1) */
     /* remove: NULL at end (1) */
+    static gsize tables_done = 0;
+
+    /* shared by all states, which may be opened from several threads */
+    if(g_once_init_enter(&tables_done)) {
+#ifdef LGLIB_X86_64
+	sha_ni_ok = checksum_selftest();
+#endif
+	crc32c_init_table();
+	g_once_init_leave(&tables_done, 1);
+    }
     lua_createtable(L, 0, sizeof(lua_funcs)/sizeof(lua_funcs[0]) + 10 - 1);
     luaL_setfuncs(L, lua_funcs, 0);
 
@@ -9985,10 +14783,24 @@ int luaopen_glib(lua_State *L)
     lua_setfield(L, -1, "__index"); \
     lua_pop(L, 1); \
 } while(0)
+    newt_free(iconv_cache);
     newt_free(convert_state);
+    newt(utf8_valid_state);
+    newt_free(utf8_window_state);
+    newt_tab(utf8_index_state);
+#if GLIB_CHECK_VERSION(2, 30, 0)
+    newt_free(normalize_state);
+#endif
     newt(base64_state);
+    newt(bits_state);
     newt_free(sumstate);
+    newt_free(multisum_state);
+    newt_free(tree_state);
+    newt(fasthash_state);
     newt_free(hmacstate);
+#if GLIB_CHECK_VERSION(2, 30, 0)
+    newt_tab(hmac_key_state);
+#endif
     newt_free(rand_state);
     newt_tab(timer_state);
     newt_tab(spawn_state);
@@ -9999,6 +14811,14 @@ int luaopen_glib(lua_State *L)
     newt_tab(key_file_state);
     newt_tab(bookmark_file_state);
 
+    /* Character Set Conversion */
+    {
+	alloc_udata(L, ic, iconv_cache);
+	ic->h = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+				      free_iconv_slot);
+	lua_setfield(L, LUA_REGISTRYINDEX, "glib.iconv");
+    }
+
     /* Internationalization */
     /* gettext macros are globals */
     lua_register(L, "_", glib_gettext);